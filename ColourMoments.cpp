@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <cmath>
+
+#include "ColourMoments.hpp"
+
+ColourMoments ColourMoments::Of(const uint8_t *samples, const size_t count) {
+  uint64_t sums[3] = {0, 0, 0}, squares[3] = {0, 0, 0};
+  for (size_t j = 0; j < count; j++) {
+    sums[j % 3] += samples[j];
+    squares[j % 3] += uint32_t(samples[j]) * samples[j];
+  }
+
+  // n times the variance is the sum of squares less the squared sum over n.
+  ColourMoments moments;
+  const double pixels = count / 3.0;
+  for (size_t c = 0; c < 3; c++) {
+    double sum = double(sums[c]);
+    moments.Moment[c] = float(sum / std::sqrt(pixels));
+    moments.Moment[3 + c] =
+        float(std::sqrt(std::max(0.0, squares[c] - sum * sum / pixels)));
+  }
+  return moments;
+}
+
+double ColourMoments::SquaredDistance(const ColourMoments &other) const {
+  double sum = 0;
+  for (size_t m = 0; m < 6; m++) {
+    double diff = double(Moment[m]) - double(other.Moment[m]);
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+void MomentTree::Build(const std::vector<ColourMoments> &moments) {
+  Order.resize(moments.size());
+  for (size_t j = 0; j < moments.size(); j++)
+    Order[j] = j;
+  Points = moments;
+
+  // A complete binary tree down to leaves of at most about LeafSize.
+  size_t leaves = 1;
+  while (leaves * LeafSize < moments.size())
+    leaves *= 2;
+  Axes.assign(2 * leaves - 1, 0);
+  Splits.assign(2 * leaves - 1, 0);
+  Split(0, 0, moments.size());
+
+  std::vector<ColourMoments> points(moments.size());
+  for (size_t j = 0; j < moments.size(); j++)
+    points[j] = moments[Order[j]];
+  Points = std::move(points);
+}
+
+void MomentTree::Split(const size_t node, const size_t first,
+                       const size_t last) {
+  if (2 * node + 1 >= Axes.size())
+    return;
+
+  float lowest[6], highest[6];
+  std::fill(lowest, lowest + 6, INFINITY);
+  std::fill(highest, highest + 6, -INFINITY);
+  for (size_t j = first; j < last; j++) {
+    for (size_t m = 0; m < 6; m++) {
+      lowest[m] = std::min(lowest[m], Points[Order[j]].Moment[m]);
+      highest[m] = std::max(highest[m], Points[Order[j]].Moment[m]);
+    }
+  }
+  size_t axis = 0;
+  for (size_t m = 1; m < 6; m++)
+    if (highest[m] - lowest[m] > highest[axis] - lowest[axis])
+      axis = m;
+
+  // Everything before the middle is at most the split, and after at least.
+  size_t middle = first + (last - first) / 2;
+  std::nth_element(Order.begin() + first, Order.begin() + middle,
+                   Order.begin() + last, [&](uint32_t a, uint32_t b) {
+                     return Points[a].Moment[axis] < Points[b].Moment[axis];
+                   });
+  Axes[node] = axis;
+  Splits[node] = middle < last ? Points[Order[middle]].Moment[axis] : 0;
+  Split(2 * node + 1, first, middle);
+  Split(2 * node + 2, middle, last);
+}
+
+void MomentTree::Within(const ColourMoments &query,
+                        const double squaredRadius,
+                        std::vector<uint32_t> &found) const {
+  if (!Points.empty())
+    Search(0, 0, Points.size(), query, squaredRadius, found);
+}
+
+void MomentTree::Search(const size_t node, const size_t first,
+                        const size_t last, const ColourMoments &query,
+                        const double squaredRadius,
+                        std::vector<uint32_t> &found) const {
+  if (2 * node + 1 >= Axes.size()) {
+    for (size_t j = first; j < last; j++)
+      if (query.SquaredDistance(Points[j]) < squaredRadius)
+        found.push_back(Order[j]);
+    return;
+  }
+
+  // A side is only skipped when the split alone puts it out of reach.
+  size_t middle = first + (last - first) / 2;
+  double offset = double(query.Moment[Axes[node]]) - double(Splits[node]);
+  if (offset <= 0 || offset * offset < squaredRadius)
+    Search(2 * node + 1, first, middle, query, squaredRadius, found);
+  if (offset >= 0 || offset * offset < squaredRadius)
+    Search(2 * node + 2, middle, last, query, squaredRadius, found);
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The mean and standard deviation of each channel of a fingerprint, scaled
+// by the square root of its pixel count. Splitting each channel into its
+// mean and what's left, the squared distance between two fingerprints is
+// the pixel count times the squared difference in means plus the squared
+// distance between the rest, which is at least the squared difference in
+// their lengths (the triangle inequality): the pixel count times the squared
+// difference in deviations. So the distance between two fingerprints'
+// moments is never more than the distance between them.
+struct ColourMoments {
+  float Moment[6]; // three scaled means, then three scaled deviations
+
+  // Moments of interleaved 8-bit RGB samples.
+  static ColourMoments Of(const uint8_t *samples, const size_t count);
+
+  double SquaredDistance(const ColourMoments &other) const;
+};
+
+// A k-d tree over the moments of a set's fingerprints, to find all of those
+// within a distance of a query without looking at the rest.
+class MomentTree {
+public:
+  void Build(const std::vector<ColourMoments> &moments);
+
+  // Every fingerprint whose moments are less than sqrt(squaredRadius) from
+  // the query's, in no particular order.
+  void Within(const ColourMoments &query, const double squaredRadius,
+              std::vector<uint32_t> &found) const;
+
+private:
+  // Fingerprints per leaf, scanned rather than split further.
+  static const size_t LeafSize = 16;
+
+  // Split [first, last) of the fingerprints at its median along the moment
+  // that varies most, and then each half, down to leaves.
+  void Split(const size_t node, const size_t first, const size_t last);
+  void Search(const size_t node, const size_t first, const size_t last,
+              const ColourMoments &query, const double squaredRadius,
+              std::vector<uint32_t> &found) const;
+
+  // The fingerprints in tree order, their moments alongside, and for each
+  // node (children of n at 2n+1 and 2n+2) the moment it splits on and where.
+  std::vector<uint32_t> Order;
+  std::vector<ColourMoments> Points;
+  std::vector<uint8_t> Axes;
+  std::vector<float> Splits;
+};
\ No newline at end of file
@@ -0,0 +1,85 @@
+#include "CompactDct.hpp"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+namespace {
+// The first count orthonormal DCT-II basis vectors of the given length.
+std::vector<double> Basis(const size_t count, const size_t length) {
+  std::vector<double> basis(count * length);
+  for (size_t k = 0; k < count; k++) {
+    double scale = std::sqrt((k == 0 ? 1.0 : 2.0) / length);
+    for (size_t n = 0; n < length; n++)
+      basis[k * length + n] =
+          scale * std::cos(M_PI * (2 * n + 1) * k / (2.0 * length));
+  }
+  return basis;
+}
+} // namespace
+
+CompactDct::CompactDct(const size_t width, const size_t height,
+                       const size_t channels)
+    : Width(width), Height(height), Channels(channels),
+      ColumnFrequencies(std::min(Frequencies, width)),
+      RowFrequencies(std::min(Frequencies, height)),
+      CoefficientCount(ColumnFrequencies * RowFrequencies * channels),
+      ColumnBasis(Basis(ColumnFrequencies, width)),
+      RowBasis(Basis(RowFrequencies, height)) {}
+
+void CompactDct::Transform(const uint8_t *samples, float *coefficients) const {
+  // Separably: first each row against the horizontal frequencies, then the
+  // columns of those against the vertical ones.
+  std::vector<double> rows(Height * ColumnFrequencies);
+  for (size_t c = 0; c < Channels; c++) {
+    for (size_t y = 0; y < Height; y++) {
+      const uint8_t *row = samples + y * Width * Channels + c;
+      for (size_t u = 0; u < ColumnFrequencies; u++) {
+        const double *basis = ColumnBasis.data() + u * Width;
+        double sum = 0;
+        for (size_t x = 0; x < Width; x++)
+          sum += basis[x] * row[x * Channels];
+        rows[y * ColumnFrequencies + u] = sum;
+      }
+    }
+
+    float *out = coefficients + c * RowFrequencies * ColumnFrequencies;
+    for (size_t v = 0; v < RowFrequencies; v++) {
+      const double *basis = RowBasis.data() + v * Height;
+      for (size_t u = 0; u < ColumnFrequencies; u++) {
+        double sum = 0;
+        for (size_t y = 0; y < Height; y++)
+          sum += basis[y] * rows[y * ColumnFrequencies + u];
+        out[v * ColumnFrequencies + u] = float(sum);
+      }
+    }
+  }
+}
+
+float CompactDct::SquaredDistance(const float *a, const float *b,
+                                  const size_t count) {
+  // Separate sums, as float addition can't be reordered into vector lanes.
+  const size_t Lanes = 8;
+  float sums[Lanes] = {};
+  size_t j = 0;
+  for (; j + Lanes <= count; j += Lanes)
+    for (size_t lane = 0; lane < Lanes; lane++) {
+      float diff = a[j + lane] - b[j + lane];
+      sums[lane] += diff * diff;
+    }
+  for (; j < count; j++) {
+    float diff = a[j] - b[j];
+    sums[0] += diff * diff;
+  }
+
+  float sum = 0;
+  for (size_t lane = 0; lane < Lanes; lane++)
+    sum += sums[lane];
+  return sum;
+}
+
+std::string CompactDct::Describe() const {
+  std::stringstream description;
+  description << ColumnFrequencies << "x" << RowFrequencies << "x" << Channels
+              << " DCT coefficients";
+  return description.str();
+}
\ No newline at end of file
@@ -0,0 +1,46 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The lowest frequencies of each channel's orthonormal 2D DCT, a few hundred
+// bytes standing in for a whole fingerprint. The transform preserves
+// distances, so the squared distance between two sets of coefficients is at
+// most the squared distance between the fingerprints they came from (the
+// dropped frequencies can only add to it). Pairs too far apart in these are
+// ruled out without reading their samples.
+class CompactDct {
+public:
+  // Frequencies kept along each axis, where the geometry allows.
+  static const size_t Frequencies = 8;
+
+  CompactDct(const size_t width, const size_t height, const size_t channels);
+
+  // Coefficients per fingerprint, as floats.
+  size_t Count() const { return CoefficientCount; }
+
+  // Transform a fingerprint's interleaved 8-bit samples into Count()
+  // coefficients, channel by channel, lowest frequencies first.
+  void Transform(const uint8_t *samples, float *coefficients) const;
+
+  // Squared distance between two fingerprints' coefficients, or any two
+  // vectors of count floats.
+  float SquaredDistance(const float *a, const float *b) const {
+    return SquaredDistance(a, b, CoefficientCount);
+  }
+  static float SquaredDistance(const float *a, const float *b,
+                               const size_t count);
+
+  // e.g. "8x8x3 DCT coefficients"
+  std::string Describe() const;
+
+private:
+  size_t Width, Height, Channels;
+  size_t ColumnFrequencies, RowFrequencies;
+  size_t CoefficientCount;
+
+  // Orthonormal DCT-II basis vectors: ColumnBasis[u * Width + x] for the
+  // horizontal frequencies, RowBasis[v * Height + y] for the vertical ones.
+  std::vector<double> ColumnBasis;
+  std::vector<double> RowBasis;
+};
\ No newline at end of file
@@ -0,0 +1,115 @@
+#include "DecodeWatchdog.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+DecodeWatchdog::DecodeWatchdog(const unsigned int timeoutSeconds)
+    : Timeout(timeoutSeconds) {}
+
+DecodeWatchdog::Watch::Watch(DecodeWatchdog *watchdog, const std::string path)
+    : Watchdog(watchdog) {
+  std::lock_guard<std::mutex> lock(Watchdog->Mutex);
+  Entry = Watchdog->Decoding.emplace(Watchdog->Decoding.end());
+  Entry->Path = path;
+  Entry->Started = std::chrono::steady_clock::now();
+}
+
+DecodeWatchdog::Watch::~Watch() { Watchdog->Finished(Entry); }
+
+void DecodeWatchdog::Watch::Monitor(MagickCore::ImageInfo *info) {
+  MagickCore::SetImageInfoProgressMonitor(info, Progress, &*Entry);
+}
+
+void DecodeWatchdog::Watch::Monitor(MagickCore::Image *image) {
+  MagickCore::SetImageProgressMonitor(image, Progress, &*Entry);
+}
+
+void DecodeWatchdog::Watch::Check() const {
+  if (Entry->Abandoned)
+    throw std::runtime_error("abandoned after exceeding the decode timeout");
+}
+
+void DecodeWatchdog::Start() {
+  if (Timeout.count() == 0)
+    return;
+
+  Worker = std::thread([this]() { Run(); });
+}
+
+void DecodeWatchdog::Finish() {
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    Stopped = true;
+  }
+  Stopping.notify_all();
+  if (Worker.joinable())
+    Worker.join();
+
+  std::stringstream msg;
+  if (!Slowest.empty()) {
+    msg << "Slowest files to decode:" << std::endl;
+    for (auto &slow : Slowest)
+      msg << std::fixed << std::setprecision(1) << "  " << slow.first
+          << "s\t" << slow.second << std::endl;
+  }
+  if (!Abandoned.empty()) {
+    msg << "Abandoned " << Abandoned.size()
+        << " files that took longer than " << Timeout.count()
+        << "s:" << std::endl;
+    for (auto &path : Abandoned)
+      msg << "  " << path << std::endl;
+  }
+  std::cerr << msg.str() << std::flush;
+}
+
+MagickCore::MagickBooleanType
+DecodeWatchdog::Progress(const char *, const MagickCore::MagickOffsetType,
+                         const MagickCore::MagickSizeType, void *data) {
+  auto entry = static_cast<InFlight *>(data);
+  return entry->Abandoned ? MagickCore::MagickFalse : MagickCore::MagickTrue;
+}
+
+void DecodeWatchdog::Finished(std::list<InFlight>::iterator entry) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - entry->Started;
+
+  std::lock_guard<std::mutex> lock(Mutex);
+  if (entry->Abandoned)
+    Abandoned.push_back(entry->Path);
+
+  // Keep a short list sorted slowest first.
+  auto slow = std::make_pair(elapsed.count(), entry->Path);
+  auto position = std::upper_bound(
+      Slowest.begin(), Slowest.end(), slow,
+      [](auto &a, auto &b) { return a.first > b.first; });
+  if (position - Slowest.begin() < long(SlowestCount)) {
+    Slowest.insert(position, slow);
+    if (Slowest.size() > SlowestCount)
+      Slowest.pop_back();
+  }
+
+  Decoding.erase(entry);
+}
+
+void DecodeWatchdog::Run() {
+  std::unique_lock<std::mutex> lock(Mutex);
+
+  while (!Stopping.wait_for(lock, std::chrono::seconds(1),
+                            [this] { return Stopped; })) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto &entry : Decoding) {
+      if (entry.Abandoned || now - entry.Started < Timeout)
+        continue;
+
+      // Coders that never report progress can't be stopped, but the result
+      // is still thrown away when they return.
+      entry.Abandoned = true;
+      std::stringstream msg;
+      msg << "abandoning " << entry.Path << " after " << Timeout.count()
+          << "s" << std::endl;
+      std::cerr << msg.str() << std::flush;
+    }
+  }
+}
@@ -0,0 +1,81 @@
+#include "Magick++.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Keeps track of every decode in flight. A background thread abandons any that
+// run past the timeout: ImageMagick's progress monitor is told to stop at its
+// next checkpoint, and the worker discards the result. The slowest and
+// abandoned files are reported at the end of the run.
+class DecodeWatchdog {
+private:
+  struct InFlight {
+    std::string Path;
+    std::chrono::steady_clock::time_point Started;
+    std::atomic<bool> Abandoned = false;
+  };
+
+public:
+  // A timeout of 0 only records timings, nothing is abandoned.
+  DecodeWatchdog(const unsigned int timeoutSeconds);
+
+  // Registers one file's decode (and resize) for as long as it's in scope.
+  class Watch {
+  public:
+    Watch(DecodeWatchdog *watchdog, const std::string path);
+    Watch(const Watch &) = delete;
+    Watch &operator=(const Watch &) = delete;
+    ~Watch();
+
+    // Install the progress monitor that stops ImageMagick once the file has
+    // been abandoned, for reading (on the ImageInfo) or processing (on the
+    // image).
+    void Monitor(MagickCore::ImageInfo *info);
+    void Monitor(MagickCore::Image *image);
+
+    // Throws if the watchdog has abandoned the file, as whatever ImageMagick
+    // returned after being stopped can't be trusted.
+    void Check() const;
+
+  private:
+    DecodeWatchdog *Watchdog;
+    std::list<InFlight>::iterator Entry;
+  };
+
+  // Starts the background thread (if there is a timeout).
+  void Start();
+
+  // Stops the background thread and writes the summary to stderr.
+  void Finish();
+
+private:
+  static MagickCore::MagickBooleanType
+  Progress(const char *text, const MagickCore::MagickOffsetType offset,
+           const MagickCore::MagickSizeType extent, void *data);
+
+  // Record how long a finished decode took.
+  void Finished(std::list<InFlight>::iterator entry);
+
+  // Background thread: abandon anything in flight for too long.
+  void Run();
+
+  std::chrono::seconds Timeout;
+
+  std::mutex Mutex;
+  std::condition_variable Stopping;
+  bool Stopped = false;
+  std::list<InFlight> Decoding;
+
+  // Slowest decodes so far, slowest first, and everything abandoned.
+  std::vector<std::pair<double, std::string>> Slowest;
+  std::vector<std::string> Abandoned;
+  const size_t SlowestCount = 10;
+
+  std::thread Worker;
+};
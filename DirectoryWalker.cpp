@@ -1,9 +1,19 @@
 #include "DirectoryWalker.hpp"
+#include "Util.hpp"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <queue>
+#include <sstream>
 
-DirectoryWalker::DirectoryWalker(const std::string directoryName)
-    : Queue(0), Directory(directoryName) {}
+#ifdef HAVE_LIBARCHIVE
+#include <archive.h>
+#include <archive_entry.h>
+#endif
+
+DirectoryWalker::DirectoryWalker(const std::string directoryName,
+                                 const bool sorted)
+    : Queue(0), Directory(directoryName), Sorted(sorted) {}
 
 void DirectoryWalker::Traverse(const bool descend = false) {
   Completed = false;
@@ -13,49 +23,196 @@ void DirectoryWalker::Traverse(const bool descend = false) {
     // TODO: Check that the directory is valid
 
     // Push the starting directory onto the queue so the loop is the same for
-    // each directory
-    std::queue<boost::filesystem::path> toBeListed;
-    toBeListed.push(Directory);
+    // each directory. Each is paired with whether it was reached through a
+    // symlink.
+    std::queue<std::pair<boost::filesystem::path, bool>> toBeListed;
+    toBeListed.push({Directory, false});
+
+    struct stat st;
+    if (stat(Directory.c_str(), &st) == 0)
+      SeenDirectories.Insert(st.st_dev, st.st_ino);
 
     for (;;) {
       if (toBeListed.empty())
         break;
 
-      boost::filesystem::path currentDir = toBeListed.front();
+      auto [currentDir, viaLink] = toBeListed.front();
       toBeListed.pop();
 
-      for (boost::filesystem::directory_entry &entry :
-           boost::filesystem::directory_iterator(currentDir)) {
+      // Directory listings come back in whatever order the filesystem keeps
+      // them, so sort them when the walk order needs to be reproducible.
+      std::vector<boost::filesystem::directory_entry> entries{
+          boost::filesystem::directory_iterator(currentDir),
+          boost::filesystem::directory_iterator()};
+      if (Sorted)
+        std::sort(entries.begin(), entries.end());
+
+      for (boost::filesystem::directory_entry &entry : entries) {
         // TODO: Print out number of entries walked in an ncurses window?
+        bool linked =
+            viaLink || boost::filesystem::is_symlink(entry.symlink_status());
+        bool known = stat(entry.path().c_str(), &st) == 0;
 
-        // Add any found directories to the traversal queue
+        // Add any found directories to the traversal queue, unless they have
+        // been listed already through another symlink (or it is a cycle).
         if (boost::filesystem::is_directory(entry)) {
-          if (descend)
-            toBeListed.push(entry);
+          if (descend &&
+              (!known || SeenDirectories.Insert(st.st_dev, st.st_ino)))
+            toBeListed.push({entry.path(), linked});
 
           continue;
         }
 
-        Queue.push(new boost::filesystem::path(entry));
+        auto original = known ? FindOriginal(entry.path(), st, linked)
+                              : std::nullopt;
+
+        if (Util::IsArchive(entry.path())) {
+          if (descend && !original)
+            ReadArchive(entry.path());
+
+          continue;
+        }
+
+        auto walkEntry = new WalkEntry{entry.path(), nullptr};
+        if (original)
+          walkEntry->AliasOf = original.value();
+        Push(walkEntry);
       }
     }
+
+    if (Aliases > 0) {
+      std::stringstream msg;
+      msg << "Found " << Aliases << " links to files already walked"
+          << std::endl;
+      std::cerr << msg.str() << std::flush;
+    }
     Completed = true;
   });
 }
 
-std::pair<std::optional<boost::filesystem::path>, bool>
-DirectoryWalker::GetNext() {
-  boost::filesystem::path *entry;
+std::pair<std::optional<WalkEntry>, bool> DirectoryWalker::GetNext() {
+  // Check for completion before popping. Otherwise the last entries could be
+  // pushed, and the traversal marked complete, in between a failed pop and
+  // reading the flag, and they would never be handed out.
+  bool completed = Completed;
+
+  WalkEntry *entry;
   bool success = Queue.pop(entry);
 
   if (!success)
-    return {std::nullopt, Completed};
+    return {std::nullopt, completed};
 
-  auto retval = boost::filesystem::path(*entry);
+  auto retval = WalkEntry(std::move(*entry));
   delete entry;
   return {retval, Completed};
 }
 
+void DirectoryWalker::Push(WalkEntry *entry) {
+  entry->Sequence = NextSequence++;
+  Queue.push(entry);
+}
+
+std::optional<boost::filesystem::path>
+DirectoryWalker::FindOriginal(const boost::filesystem::path &path,
+                              const struct stat &st, const bool linked) {
+  uint32_t index = InodeSet::NoValue;
+  if (linked || st.st_nlink > 1)
+    index = LinkedPaths.size();
+
+  uint32_t existing;
+  if (SeenFiles.Insert(st.st_dev, st.st_ino, index, &existing)) {
+    if (index != InodeSet::NoValue)
+      LinkedPaths.push_back(path);
+    return std::nullopt;
+  }
+
+  if (existing != InodeSet::NoValue) {
+    Aliases++;
+    return LinkedPaths[existing];
+  }
+
+  // The file was first seen at a path with no links, and this path must be a
+  // symlink to it.
+  boost::system::error_code error;
+  auto target = boost::filesystem::canonical(path, error);
+  if (error)
+    return std::nullopt;
+
+  Aliases++;
+  return target;
+}
+
+void DirectoryWalker::ReadArchive(const boost::filesystem::path &archivePath) {
+#ifdef HAVE_LIBARCHIVE
+  struct archive *archive = archive_read_new();
+  archive_read_support_filter_all(archive);
+  archive_read_support_format_tar(archive);
+  archive_read_support_format_zip(archive);
+
+  if (archive_read_open_filename(archive, archivePath.c_str(), 1 << 16) !=
+      ARCHIVE_OK) {
+    std::stringstream msg;
+    msg << "skipping " << archivePath.string() << " "
+        << archive_error_string(archive) << std::endl;
+    std::cerr << msg.str() << std::flush;
+    archive_read_free(archive);
+    return;
+  }
+
+  struct archive_entry *member;
+  while (archive_read_next_header(archive, &member) == ARCHIVE_OK) {
+    boost::filesystem::path name(archive_entry_pathname(member));
+
+    // Only read members that are worth decoding, everything else is skipped
+    // without being decompressed.
+    if (archive_entry_filetype(member) != AE_IFREG ||
+        !Util::IsSupportedImage(name)) {
+      archive_read_data_skip(archive);
+      continue;
+    }
+
+    // The contents are released back to the walker's allowance when the last
+    // consumer drops them.
+    auto queued = QueuedArchiveBytes;
+    auto contents = std::shared_ptr<std::vector<uint8_t>>(
+        new std::vector<uint8_t>, [queued](std::vector<uint8_t> *contents) {
+          *queued -= contents->size();
+          delete contents;
+        });
+    if (archive_entry_size_is_set(member))
+      contents->reserve(archive_entry_size(member));
+
+    uint8_t chunk[1 << 16];
+    la_ssize_t n;
+    while ((n = archive_read_data(archive, chunk, sizeof(chunk))) > 0)
+      contents->insert(contents->end(), chunk, chunk + n);
+
+    if (n < 0) {
+      std::stringstream msg;
+      msg << "skipping the rest of " << archivePath.string() << " "
+          << archive_error_string(archive) << std::endl;
+      std::cerr << msg.str() << std::flush;
+      break;
+    }
+
+    while (*QueuedArchiveBytes > MaxQueuedArchiveBytes)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    *QueuedArchiveBytes += contents->size();
+
+    auto path = archivePath;
+    path += "!" + name.generic_string();
+    Push(new WalkEntry{path, contents});
+  }
+
+  archive_read_free(archive);
+#else
+  std::stringstream msg;
+  msg << "skipping " << archivePath.string()
+      << " as archive support is not compiled in" << std::endl;
+  std::cerr << msg.str() << std::flush;
+#endif
+}
+
 void DirectoryWalker::Finish() {
   // If the directory traversal has completed, join the thread.
   // This is probably not a great way to do this. Also because we don't actually
@@ -1,33 +1,88 @@
+#include "InodeSet.hpp"
+#include <atomic>
 #include <boost/filesystem.hpp>
 #include <boost/lockfree/queue.hpp>
+#include <cstdint>
+#include <memory>
 #include <optional>
+#include <sys/stat.h>
 #include <thread>
+#include <vector>
+
+// A file found during traversal. Members of zip and tar archives are read into
+// memory by the walker and carry their contents, with a path of the form
+// "archive.tar!dir/member.jpg".
+struct WalkEntry {
+  boost::filesystem::path Path;
+  std::shared_ptr<const std::vector<uint8_t>> Contents;
+
+  // Position in walk order, counting from 0 with no gaps.
+  uint64_t Sequence = 0;
+
+  // Set when this is a hard link or symlink to a file already walked, to the
+  // path it was first seen at. There is no need to read it again.
+  boost::filesystem::path AliasOf{};
+};
 
 class DirectoryWalker {
 public:
-  DirectoryWalker(const std::string directoryName);
+  // Sorted walks list each directory in name order, so that the walk order
+  // (and the sequence numbers) are the same from one run to the next.
+  DirectoryWalker(const std::string directoryName, const bool sorted = false);
 
   // Starts the asynchronous directory traversal in a separate thread.
   // Directory entries can immediately be retrieved using GetNext();
+  // When descending, zip and tar archives are treated as directories too.
+  // Symlinks are followed, but each directory is only listed once (so cycles
+  // end) and each file is only walked once, later paths being aliases.
   void Traverse(const bool descend);
 
   // GetNext returns a pair of values -
-  // an optional next path that has been retrieved from filesystem
+  // an optional next entry that has been retrieved from filesystem
   // traversal, and a bool indicating if the overall traversal process
   // has completed or not.
-  std::pair<std::optional<boost::filesystem::path>, bool> GetNext();
+  std::pair<std::optional<WalkEntry>, bool> GetNext();
 
   // Ensures the asynchronous worker has completed before returning.
   void Finish();
 
 private:
+  // Number the entry in walk order and queue it.
+  void Push(WalkEntry *entry);
+
+  // Queue every image inside an archive, with its contents read into memory.
+  void ReadArchive(const boost::filesystem::path &archive);
+
+  // Record the first path a file is seen at, or return that path if it has
+  // been seen before. Linked is set when the path goes through a symlink.
+  std::optional<boost::filesystem::path>
+  FindOriginal(const boost::filesystem::path &path, const struct stat &st,
+               const bool linked);
+
   boost::filesystem::path Directory;
-  boost::lockfree::queue<boost::filesystem::path *,
-                         boost::lockfree::fixed_sized<false>>
+  boost::lockfree::queue<WalkEntry *, boost::lockfree::fixed_sized<false>>
       Queue;
 
+  // Bytes of archive members queued but not yet released by a consumer. The
+  // walker waits while this is over the limit, so that extracting a large
+  // archive can't run far ahead of the decoders.
+  std::shared_ptr<std::atomic<size_t>> QueuedArchiveBytes =
+      std::make_shared<std::atomic<size_t>>(0);
+  const size_t MaxQueuedArchiveBytes = 256 * 1024 * 1024;
+
+  bool Sorted;
+  uint64_t NextSequence = 0;
+
+  // Every directory listed and file walked so far. Only files that can be
+  // reached more than one way (hard links, or through a symlink) keep their
+  // first path in LinkedPaths; a symlink to any other file gets its target.
+  InodeSet SeenDirectories;
+  InodeSet SeenFiles;
+  std::vector<boost::filesystem::path> LinkedPaths;
+  size_t Aliases = 0;
+
   // Semaphore indicating that directory traversal has completed
-  bool Completed = false;
+  std::atomic<bool> Completed = false;
 
   // Reference to thread running the directory traversal
   std::thread Worker;
@@ -0,0 +1,218 @@
+#include "DistanceKernel.hpp"
+#include <algorithm>
+#include <sstream>
+#include <type_traits>
+
+DistanceKernel::DistanceKernel(const size_t samples, const size_t sampleBytes)
+    : SampleCount(samples),
+      StrideBytes((samples * sampleBytes + Alignment - 1) / Alignment *
+                  Alignment) {}
+
+namespace {
+// Register tile of the cross term: each step loads one slice of QueryTile
+// queries and FingerprintTile fingerprints and does every multiply between
+// them, keeping all the sums in vector registers.
+const size_t QueryTile = 4;
+const size_t FingerprintTile = 2;
+
+// Samples per chunk. A tile's slices of one chunk stay in L1 while the tile
+// below them is worked through, and 8-bit products sum in 32 bits within one.
+const size_t SampleChunk = 2048;
+
+// One register tile over a chunk, written out so that each of the eight sums
+// is a separate reduction the compiler keeps in its own vector register.
+inline void Tile(const uint8_t *const q[QueryTile],
+                 const uint8_t *const f[FingerprintTile], const size_t length,
+                 uint32_t sums[QueryTile][FingerprintTile]) {
+  uint32_t s00 = 0, s01 = 0, s10 = 0, s11 = 0;
+  uint32_t s20 = 0, s21 = 0, s30 = 0, s31 = 0;
+  const uint8_t *q0 = q[0], *q1 = q[1], *q2 = q[2], *q3 = q[3];
+  const uint8_t *f0 = f[0], *f1 = f[1];
+
+  for (size_t j = 0; j < length; j++) {
+    uint32_t a0 = q0[j], a1 = q1[j], a2 = q2[j], a3 = q3[j];
+    uint32_t b0 = f0[j], b1 = f1[j];
+    s00 += a0 * b0;
+    s01 += a0 * b1;
+    s10 += a1 * b0;
+    s11 += a1 * b1;
+    s20 += a2 * b0;
+    s21 += a2 * b1;
+    s30 += a3 * b0;
+    s31 += a3 * b1;
+  }
+
+  sums[0][0] = s00;
+  sums[0][1] = s01;
+  sums[1][0] = s10;
+  sums[1][1] = s11;
+  sums[2][0] = s20;
+  sums[2][1] = s21;
+  sums[3][0] = s30;
+  sums[3][1] = s31;
+}
+} // namespace
+
+void DistanceKernel::SquaredDistances(const uint8_t *queries,
+                                      const uint64_t *queryNorms,
+                                      const size_t queryCount,
+                                      const uint8_t *fingerprints,
+                                      const uint64_t *fingerprintNorms,
+                                      const size_t count,
+                                      uint64_t *distances) const {
+  CrossDistances<0>(queries, queryNorms, queryCount, fingerprints,
+                    fingerprintNorms, count, distances);
+}
+
+uint64_t DistanceKernel::SquaredNorm(const uint8_t *fingerprint) const {
+  uint64_t sum = 0;
+  for (size_t j = 0; j < Samples(); j++)
+    sum += uint32_t(fingerprint[j]) * fingerprint[j];
+  return sum;
+}
+
+template <size_t Count>
+void DistanceKernel::CrossDistances(const uint8_t *queries,
+                                    const uint64_t *queryNorms,
+                                    const size_t queryCount,
+                                    const uint8_t *fingerprints,
+                                    const uint64_t *fingerprintNorms,
+                                    const size_t count,
+                                    uint64_t *distances) const {
+  const size_t samples = Count ? Count : Samples();
+  const size_t stride = Stride();
+
+  // The dot products are accumulated in place, one chunk at a time.
+  std::fill(distances, distances + queryCount * count, 0);
+
+  for (size_t k = 0; k < samples; k += SampleChunk) {
+    const size_t length = std::min(SampleChunk, samples - k);
+
+    for (size_t f0 = 0; f0 < count; f0 += FingerprintTile) {
+      for (size_t q0 = 0; q0 < queryCount; q0 += QueryTile) {
+        // Partial tiles at the edges repeat the last row, and the extra
+        // results are dropped.
+        const uint8_t *q[QueryTile], *f[FingerprintTile];
+        for (size_t x = 0; x < QueryTile; x++)
+          q[x] = queries + std::min(q0 + x, queryCount - 1) * stride + k;
+        for (size_t y = 0; y < FingerprintTile; y++)
+          f[y] = fingerprints + std::min(f0 + y, count - 1) * stride + k;
+
+        uint32_t sums[QueryTile][FingerprintTile] = {};
+        Tile(q, f, length, sums);
+
+        for (size_t x = 0; x < QueryTile && q0 + x < queryCount; x++)
+          for (size_t y = 0; y < FingerprintTile && f0 + y < count; y++)
+            distances[(q0 + x) * count + f0 + y] += sums[x][y];
+      }
+    }
+  }
+
+  for (size_t x = 0; x < queryCount; x++)
+    for (size_t y = 0; y < count; y++) {
+      uint64_t &distance = distances[x * count + y];
+      distance = queryNorms[x] + fingerprintNorms[y] - 2 * distance;
+    }
+}
+
+std::unique_ptr<DistanceKernel>
+DistanceKernel::For(const size_t width, const size_t height,
+                    const size_t channels) {
+  if (width == 100 && height == 100 && channels == 3)
+    return std::make_unique<FixedDistanceKernel<100, 100, 3, uint8_t>>();
+  if (width == 64 && height == 64 && channels == 3)
+    return std::make_unique<FixedDistanceKernel<64, 64, 3, uint8_t>>();
+  if (width == 32 && height == 32 && channels == 3)
+    return std::make_unique<FixedDistanceKernel<32, 32, 3, uint8_t>>();
+
+  return std::make_unique<GenericDistanceKernel>(width, height, channels);
+}
+
+template <size_t Width, size_t Height, size_t Channels, typename Sample>
+uint64_t FixedDistanceKernel<Width, Height, Channels, Sample>::SquaredDistance(
+    const uint8_t *a, const uint8_t *b) const {
+  return Distance(reinterpret_cast<const Sample *>(a),
+                  reinterpret_cast<const Sample *>(b));
+}
+
+template <size_t Width, size_t Height, size_t Channels, typename Sample>
+void FixedDistanceKernel<Width, Height, Channels, Sample>::SquaredDistances(
+    const uint8_t *queries, const uint64_t *queryNorms, const size_t queryCount,
+    const uint8_t *fingerprints, const uint64_t *fingerprintNorms,
+    const size_t count, uint64_t *distances) const {
+  static_assert(sizeof(Sample) == 1, "only 8-bit samples can be multiplied");
+  CrossDistances<Count>(queries, queryNorms, queryCount, fingerprints,
+                        fingerprintNorms, count, distances);
+}
+
+template <size_t Width, size_t Height, size_t Channels, typename Sample>
+std::string
+FixedDistanceKernel<Width, Height, Channels, Sample>::Describe() const {
+  std::stringstream description;
+  description << Width << "x" << Height << "x" << Channels << " specialised";
+  return description.str();
+}
+
+template <size_t Width, size_t Height, size_t Channels, typename Sample>
+uint64_t FixedDistanceKernel<Width, Height, Channels, Sample>::Distance(
+    const Sample *a, const Sample *b) {
+  // Sums of 8-bit differences stay in 32 bits for up to 66051 samples, which
+  // keeps the vector lanes narrow; wider samples need 64 bits throughout.
+  using Diff = std::conditional_t<sizeof(Sample) == 1, int32_t, int64_t>;
+  using Sum = std::conditional_t<sizeof(Sample) == 1, uint32_t, uint64_t>;
+  constexpr size_t Block = Alignment / sizeof(Sample);
+  constexpr size_t Chunk =
+      sizeof(Sample) == 1 ? UINT32_MAX / (255 * 255) / Block * Block : Count;
+
+  a = static_cast<const Sample *>(__builtin_assume_aligned(a, Alignment));
+  b = static_cast<const Sample *>(__builtin_assume_aligned(b, Alignment));
+
+  uint64_t sum = 0;
+  for (size_t i = 0; i < Count; i += Chunk) {
+    // Constant trip count (for all but the last chunk of huge geometries).
+    constexpr size_t Full = Count < Chunk ? Count : Chunk;
+    size_t length = Count - i < Full ? Count - i : Full;
+
+    Sum chunk = 0;
+    if (length == Full) {
+      for (size_t j = 0; j < Full; j++) {
+        Diff diff = Diff(a[i + j]) - Diff(b[i + j]);
+        chunk += Sum(diff * diff);
+      }
+    } else {
+      for (size_t j = 0; j < length; j++) {
+        Diff diff = Diff(a[i + j]) - Diff(b[i + j]);
+        chunk += Sum(diff * diff);
+      }
+    }
+    sum += chunk;
+  }
+  return sum;
+}
+
+template class FixedDistanceKernel<100, 100, 3, uint8_t>;
+template class FixedDistanceKernel<64, 64, 3, uint8_t>;
+template class FixedDistanceKernel<32, 32, 3, uint8_t>;
+
+GenericDistanceKernel::GenericDistanceKernel(const size_t width,
+                                             const size_t height,
+                                             const size_t channels)
+    : DistanceKernel(width * height * channels) {
+  std::stringstream geometry;
+  geometry << width << "x" << height << "x" << channels;
+  Geometry = geometry.str();
+}
+
+uint64_t GenericDistanceKernel::SquaredDistance(const uint8_t *a,
+                                                const uint8_t *b) const {
+  uint64_t sum = 0;
+  for (size_t j = 0; j < Samples(); j++) {
+    int diff = int(a[j]) - int(b[j]);
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+std::string GenericDistanceKernel::Describe() const {
+  return Geometry + " generic";
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Sum of squared sample differences between two fingerprints, the core of the
+// RMSE comparison. Fingerprints are stored Stride() bytes apart, padded to a
+// multiple of Alignment, and each one starts Alignment-aligned (arenas are
+// page-aligned), which the kernels rely on.
+class DistanceKernel {
+public:
+  static const size_t Alignment = 64;
+
+  DistanceKernel(const size_t samples, const size_t sampleBytes = 1);
+  virtual ~DistanceKernel() = default;
+
+  // Samples in one fingerprint, and the bytes between consecutive ones.
+  size_t Samples() const { return SampleCount; }
+  size_t Stride() const { return StrideBytes; }
+
+  virtual uint64_t SquaredDistance(const uint8_t *a,
+                                   const uint8_t *b) const = 0;
+
+  // Squared distances from each of a batch of queries to each of a range of
+  // fingerprints, both Stride() apart, into a queryCount x count row-major
+  // matrix. Computed as |q|^2 + |f|^2 - 2 q.f, so the cross terms are a
+  // matrix multiply: register-blocked tiles of queries and fingerprints, with
+  // the samples cut into chunks so each tile's slices stay in L1. The norms
+  // are from SquaredNorm(). With 8-bit samples every term is an exact integer,
+  // so the results are identical to SquaredDistance().
+  virtual void SquaredDistances(const uint8_t *queries,
+                                const uint64_t *queryNorms,
+                                const size_t queryCount,
+                                const uint8_t *fingerprints,
+                                const uint64_t *fingerprintNorms,
+                                const size_t count, uint64_t *distances) const;
+
+  // Sum of the squares of a fingerprint's samples.
+  uint64_t SquaredNorm(const uint8_t *fingerprint) const;
+
+  // e.g. "100x100x3 specialised"
+  virtual std::string Describe() const = 0;
+
+  // The kernel for a fingerprint geometry: one of the specialised kernels
+  // compiled in below if there is one, otherwise the generic kernel.
+  static std::unique_ptr<DistanceKernel>
+  For(const size_t width, const size_t height, const size_t channels);
+
+protected:
+  // The matrix multiply behind SquaredDistances, for 8-bit samples. Count is
+  // the number of samples when known at compile time, or 0 to use Samples().
+  template <size_t Count>
+  void CrossDistances(const uint8_t *queries, const uint64_t *queryNorms,
+                      const size_t queryCount, const uint8_t *fingerprints,
+                      const uint64_t *fingerprintNorms, const size_t count,
+                      uint64_t *distances) const;
+
+private:
+  size_t SampleCount;
+  size_t StrideBytes;
+};
+
+// Kernel with the geometry, channel count and sample type fixed at compile
+// time. Every loop bound is a constant and both fingerprints are known to be
+// aligned, so the compiler unrolls and vectorises the whole comparison with no
+// peeling or remainder loops, accumulating in the narrowest safe lanes.
+template <size_t Width, size_t Height, size_t Channels, typename Sample>
+class FixedDistanceKernel : public DistanceKernel {
+public:
+  static constexpr size_t Count = Width * Height * Channels;
+
+  FixedDistanceKernel() : DistanceKernel(Count, sizeof(Sample)) {}
+
+  uint64_t SquaredDistance(const uint8_t *a, const uint8_t *b) const override;
+  void SquaredDistances(const uint8_t *queries, const uint64_t *queryNorms,
+                        const size_t queryCount, const uint8_t *fingerprints,
+                        const uint64_t *fingerprintNorms, const size_t count,
+                        uint64_t *distances) const override;
+  std::string Describe() const override;
+
+  static uint64_t Distance(const Sample *a, const Sample *b);
+};
+
+// Any geometry, with the sample count only known at runtime.
+class GenericDistanceKernel : public DistanceKernel {
+public:
+  GenericDistanceKernel(const size_t width, const size_t height,
+                        const size_t channels);
+
+  uint64_t SquaredDistance(const uint8_t *a, const uint8_t *b) const override;
+  std::string Describe() const override;
+
+private:
+  std::string Geometry;
+};
+
+// The specialised configurations, instantiated in DistanceKernel.cpp.
+extern template class FixedDistanceKernel<100, 100, 3, uint8_t>;
+extern template class FixedDistanceKernel<64, 64, 3, uint8_t>;
+extern template class FixedDistanceKernel<32, 32, 3, uint8_t>;
\ No newline at end of file
@@ -0,0 +1,467 @@
+#include "DirectoryWalker.hpp"
+#include "FileReader.hpp"
+#include "OutputSink.hpp"
+#include "Util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <atomic>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+#ifdef HAVE_IO_URING
+// Minimal io_uring wrapper over the raw system calls, covering just what the
+// reader needs: queue whole-file reads and wait for all of them.
+class Uring {
+public:
+  Uring(const unsigned int entries) {
+    io_uring_params params = {};
+    Fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (Fd < 0)
+      return;
+
+    SqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    CqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      SqSize = CqSize = std::max(SqSize, CqSize);
+
+    SqRing = mmap(nullptr, SqSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQ_RING);
+    CqRing = (params.features & IORING_FEAT_SINGLE_MMAP)
+                 ? SqRing
+                 : mmap(nullptr, CqSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_CQ_RING);
+    SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    Sqes = static_cast<io_uring_sqe *>(
+        mmap(nullptr, SqesSize, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQES));
+    if (SqRing == MAP_FAILED || CqRing == MAP_FAILED || Sqes == MAP_FAILED) {
+      Close();
+      return;
+    }
+
+    auto sq = static_cast<uint8_t *>(SqRing);
+    SqTail = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+    SqMask = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+    SqArray = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+    SqEntries = params.sq_entries;
+
+    auto cq = static_cast<uint8_t *>(CqRing);
+    CqHead = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+    CqTail = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+    CqMask = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+    Cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  }
+
+  ~Uring() { Close(); }
+
+  bool Valid() const { return Fd >= 0; }
+  unsigned int Entries() const { return SqEntries; }
+
+  // Queue a read; it isn't submitted to the kernel until Wait().
+  void Read(const int fd, void *buffer, const uint32_t length,
+            const uint64_t offset, const uint64_t tag) {
+    uint32_t tail = *SqTail;
+    uint32_t index = tail & SqMask;
+    io_uring_sqe *sqe = &Sqes[index];
+    *sqe = {};
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    SqArray[index] = index;
+    __atomic_store_n(SqTail, tail + 1, __ATOMIC_RELEASE);
+    Queued++;
+  }
+
+  // Submit everything queued and call done(tag, result) for each completion.
+  template <typename Callback> bool Wait(Callback done) {
+    unsigned int outstanding = Queued;
+    unsigned int toSubmit = Queued;
+    Queued = 0;
+
+    while (outstanding > 0) {
+      int ret = syscall(__NR_io_uring_enter, Fd, toSubmit, 1,
+                        IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret < 0 && errno != EINTR)
+        return false;
+      if (ret > 0)
+        toSubmit -= std::min<unsigned int>(toSubmit, ret);
+
+      uint32_t head = *CqHead;
+      uint32_t tail = __atomic_load_n(CqTail, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++, outstanding--) {
+        io_uring_cqe *cqe = &Cqes[head & CqMask];
+        done(cqe->user_data, cqe->res);
+      }
+      __atomic_store_n(CqHead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+  }
+
+private:
+  void Close() {
+    if (Sqes != MAP_FAILED && Sqes != nullptr)
+      munmap(Sqes, SqesSize);
+    if (CqRing != MAP_FAILED && CqRing != nullptr && CqRing != SqRing)
+      munmap(CqRing, CqSize);
+    if (SqRing != MAP_FAILED && SqRing != nullptr)
+      munmap(SqRing, SqSize);
+    if (Fd >= 0)
+      close(Fd);
+    Fd = -1;
+    SqRing = CqRing = nullptr;
+    Sqes = nullptr;
+  }
+
+  int Fd = -1;
+  void *SqRing = nullptr, *CqRing = nullptr;
+  io_uring_sqe *Sqes = nullptr;
+  size_t SqSize = 0, CqSize = 0, SqesSize = 0;
+  uint32_t *SqTail = nullptr, *SqArray = nullptr, SqMask = 0;
+  uint32_t *CqHead = nullptr, *CqTail = nullptr, CqMask = 0;
+  io_uring_cqe *Cqes = nullptr;
+  unsigned int SqEntries = 0;
+  unsigned int Queued = 0;
+};
+#endif
+} // namespace
+
+FileReader::FileReader(DirectoryWalker *dw, OutputSink *sink,
+                       const unsigned int queueDepth, const bool mapFiles)
+    : Walker(dw), Sink(sink), QueueDepth(queueDepth), MapFiles(mapFiles) {
+  // Twice the queue depth, so one batch can be decoding while the next is
+  // being read.
+  for (unsigned int i = 0; !MapFiles && i < QueueDepth * 2; i++) {
+    Buffers.push_back(std::make_unique<std::vector<uint8_t>>());
+    FreeBuffers.push_back(Buffers.back().get());
+  }
+}
+
+void FileReader::Start() {
+  if (QueueDepth == 0)
+    return;
+
+  Worker = std::thread([this]() { Run(); });
+}
+
+std::optional<ImageFile> FileReader::GetNext() {
+  if (QueueDepth == 0)
+    return GetNextFromWalker();
+
+  std::unique_lock<std::mutex> lock(Mutex);
+  Changed.wait(lock, [this] { return !Ready.empty() || Completed; });
+  if (Ready.empty())
+    return std::nullopt;
+
+  ImageFile file = std::move(Ready.front());
+  Ready.pop_front();
+  Changed.notify_all();
+  return file;
+}
+
+void FileReader::Finish() {
+  if (Worker.joinable())
+    Worker.join();
+}
+
+void FileReader::Run() {
+  std::vector<Pending> batch;
+
+  while (true) {
+    auto next = Walker->GetNext();
+    std::optional<WalkEntry> entry = next.first;
+    bool completed = next.second;
+
+    // Read what has been collected whenever the batch is full, or the walker
+    // has nothing more for the moment.
+    if ((!entry.has_value() && !batch.empty()) || batch.size() >= QueueDepth) {
+      ReadBatch(batch);
+      batch.clear();
+    }
+
+    if (!entry.has_value() && completed)
+      break;
+
+    if (!entry.has_value()) {
+      sleep(1);
+      continue;
+    }
+
+    // Only the header is read from anything that turns out not to be an image
+    auto format = Sniff(entry.value());
+    if (!format)
+      continue;
+
+    // Archive members have already been read by the walker, and links don't
+    // need reading. Anything batched before them is read first, to keep the
+    // files in walk order.
+    if (entry->Contents || !entry->AliasOf.empty()) {
+      ReadBatch(batch);
+      batch.clear();
+      std::lock_guard<std::mutex> lock(Mutex);
+      Ready.push_back(FromEntry(entry.value(), *format));
+      Changed.notify_all();
+      continue;
+    }
+
+    if (MapFiles) {
+      MapAhead(entry.value(), *format);
+      continue;
+    }
+
+    Pending pending;
+    pending.Path = entry->Path;
+    pending.Sequence = entry->Sequence;
+    pending.Format = *format;
+    batch.push_back(std::move(pending));
+  }
+
+  ReadBatch(batch);
+
+  std::lock_guard<std::mutex> lock(Mutex);
+  Completed = true;
+  Changed.notify_all();
+}
+
+void FileReader::ReadBatch(std::vector<Pending> &batch) {
+  if (batch.empty())
+    return;
+
+  for (auto &pending : batch) {
+    struct stat st;
+    pending.Fd = open(pending.Path.c_str(), O_RDONLY);
+    if (pending.Fd < 0 || fstat(pending.Fd, &st) != 0) {
+      pending.Failed = true;
+      continue;
+    }
+
+    pending.Size = st.st_size;
+    pending.Buffer = AcquireBuffer();
+    pending.Buffer->resize(pending.Size);
+  }
+
+  if (!ReadBatchUring(batch))
+    ReadBatchSync(batch);
+
+  std::lock_guard<std::mutex> lock(Mutex);
+  for (auto &pending : batch) {
+    if (pending.Fd >= 0)
+      close(pending.Fd);
+
+    if (pending.Failed) {
+      std::stringstream msg;
+      msg << "skipping " << pending.Path.string() << " as it can't be read"
+          << std::endl;
+      std::cerr << msg.str() << std::flush;
+      Sink->Skip(pending.Sequence);
+      continue;
+    }
+
+    ImageFile file;
+    file.Path = pending.Path;
+    file.Sequence = pending.Sequence;
+    file.Format = std::move(pending.Format);
+    file.Data = pending.Buffer->data();
+    file.Size = pending.Size;
+    file.Owner = std::move(pending.Buffer);
+    Ready.push_back(std::move(file));
+  }
+  Changed.notify_all();
+}
+
+bool FileReader::ReadBatchUring(std::vector<Pending> &batch) {
+#ifdef HAVE_IO_URING
+  // One ring for the life of the reader thread. If the kernel doesn't support
+  // io_uring (or it's disabled by seccomp) everything falls back to pread().
+  thread_local Uring ring(QueueDepth);
+  if (!ring.Valid() || batch.size() > ring.Entries())
+    return false;
+
+  // Short reads and errors are finished off synchronously below.
+  std::vector<size_t> done(batch.size(), 0);
+  for (size_t i = 0; i < batch.size(); i++) {
+    auto &pending = batch[i];
+    if (pending.Failed || pending.Size == 0 || pending.Size > UINT32_MAX)
+      continue;
+    ring.Read(pending.Fd, pending.Buffer->data(), pending.Size, 0, i);
+  }
+
+  bool ok = ring.Wait([&](uint64_t tag, int32_t res) {
+    if (res > 0)
+      done[tag] = res;
+  });
+  if (!ok)
+    return false;
+
+  for (size_t i = 0; i < batch.size(); i++) {
+    auto &pending = batch[i];
+    while (!pending.Failed && done[i] < pending.Size) {
+      ssize_t n = pread(pending.Fd, pending.Buffer->data() + done[i],
+                        pending.Size - done[i], done[i]);
+      if (n <= 0)
+        pending.Failed = true;
+      else
+        done[i] += n;
+    }
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void FileReader::ReadBatchSync(std::vector<Pending> &batch) {
+  for (auto &pending : batch) {
+    size_t done = 0;
+    while (!pending.Failed && done < pending.Size) {
+      ssize_t n = pread(pending.Fd, pending.Buffer->data() + done,
+                        pending.Size - done, done);
+      if (n <= 0)
+        pending.Failed = true;
+      else
+        done += n;
+    }
+  }
+}
+
+void FileReader::MapAhead(const WalkEntry &entry, const std::string &format) {
+  const boost::filesystem::path &path = entry.Path;
+
+  {
+    std::unique_lock<std::mutex> lock(Mutex);
+    Changed.wait(lock, [this] { return Ready.size() < QueueDepth; });
+  }
+
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    // Populating the mapping faults the whole file in here, on the reader
+    // thread, rather than page by page in the decoder.
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    mapping = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+  }
+  if (fd >= 0)
+    close(fd);
+
+  if (mapping == MAP_FAILED) {
+    std::stringstream msg;
+    msg << "skipping " << path.string() << " as it can't be mapped"
+        << std::endl;
+    std::cerr << msg.str() << std::flush;
+    Sink->Skip(entry.Sequence);
+    return;
+  }
+
+  size_t size = st.st_size;
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  madvise(mapping, size, MADV_WILLNEED);
+
+  ImageFile file;
+  file.Path = path;
+  file.Sequence = entry.Sequence;
+  file.Format = format;
+  file.Data = static_cast<const uint8_t *>(mapping);
+  file.Size = size;
+  file.Owner = std::shared_ptr<const void>(
+      mapping, [size](const void *mapping) {
+        munmap(const_cast<void *>(mapping), size);
+      });
+
+  std::lock_guard<std::mutex> lock(Mutex);
+  Ready.push_back(std::move(file));
+  Changed.notify_all();
+}
+
+std::shared_ptr<std::vector<uint8_t>> FileReader::AcquireBuffer() {
+  std::unique_lock<std::mutex> lock(Mutex);
+  Changed.wait(lock, [this] { return !FreeBuffers.empty(); });
+  std::vector<uint8_t> *buffer = FreeBuffers.back();
+  FreeBuffers.pop_back();
+
+  return std::shared_ptr<std::vector<uint8_t>>(
+      buffer, [this](std::vector<uint8_t> *buffer) {
+        std::lock_guard<std::mutex> lock(Mutex);
+        FreeBuffers.push_back(buffer);
+        Changed.notify_all();
+      });
+}
+
+std::optional<ImageFile> FileReader::GetNextFromWalker() {
+  while (true) {
+    auto next = Walker->GetNext();
+    std::optional<WalkEntry> entry = next.first;
+    bool completed = next.second;
+
+    // No next value as the directory traversal has completed.
+    if (!entry.has_value() && completed)
+      return std::nullopt;
+
+    // We may not have an entry, but if directory traversal hasn't completed, we
+    // should wait for the next one.
+    if (!entry.has_value() && !completed) {
+      sleep(1);
+      continue;
+    }
+
+    // Filter only files that look like supported images
+    auto format = Sniff(entry.value());
+    if (!format)
+      continue;
+
+    if (entry->Contents || !entry->AliasOf.empty())
+      return FromEntry(entry.value(), *format);
+
+    ImageFile file;
+    file.Path = entry->Path;
+    file.Sequence = entry->Sequence;
+    file.Format = *format;
+    return file;
+  }
+}
+
+std::optional<std::string> FileReader::Sniff(const WalkEntry &entry) {
+  std::optional<std::string> format;
+  if (entry.Contents)
+    format = Util::SniffImageFormat(entry.Contents->data(),
+                                    entry.Contents->size());
+  else
+    format = Util::SniffImageFormat(entry.Path);
+
+  if (!format) {
+    RejectedCount++;
+    Sink->Skip(entry.Sequence);
+  }
+  return format;
+}
+
+ImageFile FileReader::FromEntry(const WalkEntry &entry,
+                                const std::string &format) {
+  ImageFile file;
+  file.Path = entry.Path;
+  file.Sequence = entry.Sequence;
+  file.Format = format;
+  file.AliasOf = entry.AliasOf;
+  if (entry.Contents) {
+    file.Data = entry.Contents->data();
+    file.Size = entry.Contents->size();
+    file.Owner = entry.Contents;
+  }
+  return file;
+}
\ No newline at end of file
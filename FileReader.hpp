@@ -0,0 +1,124 @@
+#include <atomic>
+#include <boost/filesystem.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+class DirectoryWalker;
+class OutputSink;
+struct WalkEntry;
+
+// An image file handed to a worker. When the reader stage is enabled the whole
+// file is already in memory (read into a buffer, or mapped); otherwise Data is
+// null and the decoder opens the file by path itself.
+struct ImageFile {
+  boost::filesystem::path Path;
+  const uint8_t *Data = nullptr;
+  size_t Size = 0;
+
+  // Walk order of the file, for the output sink.
+  uint64_t Sequence = 0;
+
+  // ImageMagick format sniffed from the file's magic bytes.
+  std::string Format;
+
+  // Set for a link to a file already handed out; it isn't read at all.
+  boost::filesystem::path AliasOf;
+
+  // Keeps the buffer out of the reader's pool, or the file mapped, until the
+  // worker is done with it.
+  std::shared_ptr<const void> Owner;
+};
+
+// Reader stage between the DirectoryWalker and the workers. It reads whole
+// image files in batches into a pool of reusable buffers, using io_uring on
+// Linux so that many reads are in flight from a single thread, or pread()
+// where io_uring isn't available.
+//
+// Alternatively it can mmap() each file instead, with sequential and
+// will-need advice, pre-faulting the next files while workers decode the
+// current ones. Workers then decode straight from the mapping.
+class FileReader {
+public:
+  // A queue depth of 0 disables the reader stage: paths from the walker are
+  // passed straight through and workers do their own I/O. Otherwise it is the
+  // number of files read per batch, or kept mapped ahead of the workers.
+  //
+  // Only files whose magic bytes identify a supported image are handed out,
+  // whatever they are named. Entries that are filtered out or can't be read
+  // are completed on the sink here, as workers never see them.
+  FileReader(DirectoryWalker *dw, OutputSink *sink,
+             const unsigned int queueDepth, const bool mapFiles);
+
+  // Starts the reader thread (if enabled).
+  void Start();
+
+  // Blocks until another file is ready. Returns nullopt once the directory
+  // traversal has completed and every file has been handed out.
+  std::optional<ImageFile> GetNext();
+
+  // Ensures the reader thread has completed before returning.
+  void Finish();
+
+  // Number of files rejected by their magic bytes without being read.
+  size_t Rejected() const { return RejectedCount; }
+
+private:
+  struct Pending {
+    boost::filesystem::path Path;
+    uint64_t Sequence = 0;
+    std::string Format;
+    int Fd = -1;
+    std::shared_ptr<std::vector<uint8_t>> Buffer;
+    size_t Size = 0;
+    bool Failed = false;
+  };
+
+  // Reader thread: collect batches of paths from the walker and read them.
+  void Run();
+
+  // Read every file in the batch, through io_uring when possible.
+  void ReadBatch(std::vector<Pending> &batch);
+  bool ReadBatchUring(std::vector<Pending> &batch);
+  void ReadBatchSync(std::vector<Pending> &batch);
+
+  // Map a whole file and queue it, waiting while QueueDepth mapped files are
+  // already waiting for a worker.
+  void MapAhead(const WalkEntry &entry, const std::string &format);
+
+  // Take a buffer from the pool, blocking while they are all in use. It goes
+  // back to the pool when the last reference is dropped.
+  std::shared_ptr<std::vector<uint8_t>> AcquireBuffer();
+
+  // Pass-through mode: poll the walker for the next supported image.
+  std::optional<ImageFile> GetNextFromWalker();
+
+  // Sniff the format of an entry, from memory if the walker has already read
+  // it. Entries that aren't a supported image are skipped on the sink.
+  std::optional<std::string> Sniff(const WalkEntry &entry);
+
+  // Hand out an entry that needs no reading: an archive member the walker
+  // has already read into memory, or a link to a file already handed out.
+  static ImageFile FromEntry(const WalkEntry &entry, const std::string &format);
+
+  DirectoryWalker *Walker;
+  OutputSink *Sink;
+  unsigned int QueueDepth;
+  bool MapFiles;
+
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  std::deque<ImageFile> Ready;
+  std::vector<std::vector<uint8_t> *> FreeBuffers;
+  std::vector<std::unique_ptr<std::vector<uint8_t>>> Buffers;
+  bool Completed = false;
+  std::atomic<size_t> RejectedCount{0};
+
+  std::thread Worker;
+};
@@ -1,17 +1,66 @@
+#include "ColourMoments.hpp"
+#include "CompactDct.hpp"
+#include "DecodeWatchdog.hpp"
 #include "DirectoryWalker.hpp"
+#include "DistanceKernel.hpp"
+#include "FileReader.hpp"
+#include "HnswIndex.hpp"
+#include "InvertedFile.hpp"
+#include "LshIndex.hpp"
+#include "MemoryBudget.hpp"
+#include "Numa.hpp"
+#include "OutputSink.hpp"
+#include "PivotTable.hpp"
+#include "PixelArena.hpp"
+#include "ProductQuantiser.hpp"
+#include "TaskQueue.hpp"
+#include "TinyImages.hpp"
 #include "Util.hpp"
+#include "WaveletIndex.hpp"
+#include <algorithm>
 #include <boost/filesystem.hpp>
+#include <cmath>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <queue>
 #include <sstream>
+#include <stdexcept>
 #include <thread>
+#include <unordered_map>
 
 #include "FingerprintStore.hpp"
 
+std::string ApproximateSearch::Describe() const {
+  std::vector<std::string> parts;
+  if (Breadth > 0)
+    parts.push_back("HNSW searches of breadth " + std::to_string(Breadth));
+  if (Probes > 0)
+    parts.push_back("scans of the nearest " + std::to_string(Probes) +
+                    " inverted lists");
+  if (Shortlist > 0)
+    parts.push_back("shortlists of the nearest " + std::to_string(Shortlist) +
+                    " by product quantised codes");
+  if (Tables > 0)
+    parts.push_back("lookups in " + std::to_string(Tables) +
+                    " random projection hash tables");
+  if (Scored > 0)
+    parts.push_back("the best " + std::to_string(Scored) +
+                    " by wavelet signature");
+
+  std::string description;
+  for (auto &part : parts)
+    description += (description.empty() ? "" : ", ") + part;
+  return description;
+}
+
 FingerprintStore::FingerprintStore(std::string srcDirectory)
     : SrcDirectory(srcDirectory){};
 
-void FingerprintStore::Load() {
+void FingerprintStore::Load(const size_t threads,
+                            const ApproximateSearch &approximate) {
+  Threads = threads;
+
   // Start iteration through all files in the directory
   DirectoryWalker dw(SrcDirectory);
   dw.Traverse(true);
@@ -19,9 +68,15 @@ void FingerprintStore::Load() {
   std::cout << "Loading fingerprints into memory..." << std::endl;
   int loadedCount = 0;
 
+  // Samples are collected here first, one vector per set, as the final arena
+  // sizes aren't known until the traversal has completed. Each fingerprint is
+  // padded out to its kernel's stride.
+  std::vector<std::vector<uint8_t>> samples;
+  Sets.clear();
+
   while (true) {
     auto next = dw.GetNext();
-    std::optional<boost::filesystem::path> entry = next.first;
+    std::optional<WalkEntry> entry = next.first;
     bool completed = next.second;
 
     // No next value as the directory traversal has completed.
@@ -35,15 +90,54 @@ void FingerprintStore::Load() {
       continue;
     }
 
-    // Filter only known image suffixes
-    if (!Util::IsSupportedImage(entry.value()))
+    // Filter only known image suffixes, and load each file only once
+    if (!Util::IsSupportedImage(entry->Path) || !entry->AliasOf.empty())
       continue;
 
-    auto filename = entry.value().string();
+    auto filename = entry->Path.string();
     Magick::Image image;
 
-    image.read(filename);
-    Fingerprints.push_back(std::pair(image, entry.value().stem().string()));
+    ImageFile file;
+    file.Path = entry->Path;
+    if (entry->Contents) {
+      file.Data = entry->Contents->data();
+      file.Size = entry->Contents->size();
+    }
+    Decode(file, image, nullptr);
+
+    // Fingerprints are grouped by geometry, as only those of the same size
+    // can be compared sample by sample.
+    std::stringstream spec;
+    spec << image.columns() << "x" << image.rows() << "!";
+    auto set = std::find_if(Sets.begin(), Sets.end(), [&](auto &set) {
+      return set.Spec == spec.str();
+    });
+    if (set == Sets.end()) {
+      FingerprintSet added;
+      added.Spec = spec.str();
+      added.Kernel = DistanceKernel::For(image.columns(), image.rows(), 3);
+      added.Dct =
+          std::make_unique<CompactDct>(image.columns(), image.rows(), 3);
+      added.Tiny =
+          std::make_unique<TinyImages>(image.columns(), image.rows());
+      Sets.push_back(std::move(added));
+      samples.emplace_back();
+      set = Sets.end() - 1;
+    }
+    auto &setSamples = samples[set - Sets.begin()];
+
+    size_t stride = set->Kernel->Stride();
+    setSamples.resize(setSamples.size() + stride);
+    ExportSamples(image, setSamples.data() + setSamples.size() - stride);
+
+    // Pull the fingerprint match name from the fingerprint metadata if
+    // available.
+    std::string fingerprintName = image.attribute("comment");
+    if (fingerprintName == "") {
+      fingerprintName = entry->Path.stem().string();
+    }
+    set->Names.push_back(fingerprintName);
+
     loadedCount++;
     std::stringstream msg;
     msg << "\r" << loadedCount;
@@ -52,72 +146,679 @@ void FingerprintStore::Load() {
 
   // Wait also on the directory traversal thread to complete.
   dw.Finish();
+
   std::cout << "\rDONE\n" << std::flush;
+  for (size_t i = 0; i < Sets.size(); i++) {
+    auto &set = Sets[i];
+    IndexSet(set, samples[i], approximate);
+
+    std::cerr << set.Names.size() << " fingerprints of " << set.Spec << " in "
+              << samples[i].size() / 1024 << " kB using "
+              << set.Arenas[0].Describe() << ", compared with the "
+              << set.Kernel->Describe() << " kernel, screened by "
+              << set.Tiny->Describe() << ", " << set.Pivots.Pivots().size()
+              << " pivots and "
+              << set.Dct->Describe() << std::endl;
+  }
 }
 
-void FingerprintStore::FindMatchesForImage(Magick::Image image,
-                                           const std::string filename,
-                                           const int fuzzFactor) {
-  for (std::vector<std::pair<Magick::Image, std::string>>::iterator it =
-           Fingerprints.begin();
-       it != Fingerprints.end(); ++it) {
+void FingerprintStore::IndexSet(FingerprintSet &set,
+                                const std::vector<uint8_t> &samples,
+                                const ApproximateSearch &approximate) {
+  const DistanceKernel &kernel = *set.Kernel;
+  const size_t stride = kernel.Stride();
+  const size_t count = set.Names.size();
 
-    // Compare the image to the fingerprint for total number of non-matching
-    // pixels. Distortion will be the pixel count. 100x100 gives a minimum of 0
-    // and max of 10000.
-    image.colorFuzz(fuzzFactor);
-    auto distortion =
-        image.compare(it->first, Magick::RootMeanSquaredErrorMetric);
+  std::vector<ChannelSums> sums;
+  for (size_t j = 0; j < count; j++)
+    sums.push_back(SumChannels(samples.data() + j * stride, kernel.Samples()));
 
-    std::stringstream msg;
-    msg << filename;
+  // Ties are broken by name, so that the order (which the saved pivot table
+  // depends on) doesn't change with the order the files were walked in.
+  std::vector<size_t> order(count);
+  for (size_t j = 0; j < count; j++)
+    order[j] = j;
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (sums[a].Total() != sums[b].Total())
+      return sums[a].Total() < sums[b].Total();
+    return set.Names[a] < set.Names[b];
+  });
 
-    // Pull the fingerprint match name from the fingerprint metadata if
-    // available.
-    std::string fingerprintName = it->first.attribute("comment");
-    if (fingerprintName == "") {
-      fingerprintName = it->second;
+  std::vector<std::string> names;
+  set.Arenas.clear();
+  set.Arenas.emplace_back(samples.size());
+  for (size_t j = 0; j < count; j++) {
+    uint8_t *fingerprint = set.Arenas[0].Data() + j * stride;
+    std::memcpy(fingerprint, samples.data() + order[j] * stride, stride);
+    names.push_back(std::move(set.Names[order[j]]));
+    set.Sums.push_back(sums[order[j]]);
+    set.Moments.push_back(ColourMoments::Of(fingerprint, kernel.Samples()));
+    set.Norms.push_back(kernel.SquaredNorm(fingerprint));
+  }
+  set.Names = std::move(names);
+  set.MomentIndex.Build(set.Moments);
+
+  const double limit =
+      HighDistortionThreshold * 255.0 * std::sqrt(kernel.Samples());
+  set.Tiny->Build(set.Arenas[0].Data(), count, stride, Threads);
+  set.TinyThreshold = set.Tiny->Threshold(limit * limit);
+
+  // The transforms are independent, and on a large store add up to a while,
+  // so they are shared out between the threads.
+  const size_t coefficients = set.Dct->Count();
+  set.Coefficients.resize(count * coefficients);
+  Util::Parallel(count, Threads, [&](size_t first, size_t last) {
+    for (size_t j = first; j < last; j++)
+      set.Dct->Transform(set.Arenas[0].Data() + j * stride,
+                         set.Coefficients.data() + j * coefficients);
+  });
+
+  // Building the table takes a pass over the store per pivot, so it's kept
+  // with the store, one per geometry.
+  auto path = StorePath(SrcDirectory, "pivots", set.Spec);
+  uint64_t checksum = Checksum(set, Threads);
+  if (!set.Pivots.Read(path, checksum, count)) {
+    std::cout << "Building pivot table for " << set.Spec << "..." << std::endl;
+    set.Pivots.Build(kernel, set.Arenas[0].Data(), count, Threads);
+    set.Pivots.Write(path, checksum);
+  }
+
+  if (approximate.Breadth > 0)
+    IndexGraph(set);
+  if (approximate.Probes > 0)
+    IndexLists(set);
+  if (approximate.Shortlist > 0)
+    IndexCodes(set);
+  if (approximate.Tables > 0)
+    IndexHashes(set, approximate.Tables);
+  if (approximate.Scored > 0)
+    IndexWavelets(set);
+
+  set.BlockSize = std::max<size_t>(1, Util::L2CacheBytes() / 2 / stride);
+}
+
+void FingerprintStore::IndexGraph(FingerprintSet &set) {
+  const size_t count = set.Names.size();
+  const size_t coefficients = set.Dct->Count();
+  auto path = StorePath(SrcDirectory, "hnsw", set.Spec);
+  set.Graph = ReadGraph(path, coefficients);
+
+  // Generate names each node after its fingerprint. Only the current node
+  // for each fingerprint still in the store is kept, and only if its vector
+  // is the fingerprint's (give or take a level per sample, for rounding);
+  // the rest are of photos since removed, or edited and generated again
+  // without the graph.
+  std::unordered_map<std::string, size_t> fingerprints;
+  for (size_t j = 0; j < count; j++)
+    fingerprints.emplace(set.Names[j], j);
+  std::vector<bool> keep(set.Graph->Size());
+  size_t dropped = 0;
+  for (uint32_t node = 0; node < set.Graph->Size(); node++) {
+    const std::string &name = set.Graph->Name(node);
+    auto found = fingerprints.find(name);
+    keep[node] = found != fingerprints.end() &&
+                 set.Graph->Find(name) == node &&
+                 set.Dct->SquaredDistance(
+                     set.Graph->Vector(node),
+                     set.Coefficients.data() + found->second * coefficients) <=
+                     set.Kernel->Samples();
+    dropped += !keep[node];
+  }
+  if (dropped > 0) {
+    std::cout << "Dropping " << dropped << " stale nodes of " << set.Spec
+              << " from the HNSW graph..." << std::endl;
+    set.Graph->Retain(keep, Threads);
+  }
+
+  std::vector<bool> linked(count);
+  set.GraphFingerprints.resize(set.Graph->Size());
+  for (uint32_t node = 0; node < set.Graph->Size(); node++) {
+    size_t fingerprint = fingerprints[set.Graph->Name(node)];
+    set.GraphFingerprints[node] = fingerprint;
+    linked[fingerprint] = true;
+  }
+
+  // Anything else, from before there were graphs or copied in by hand, is
+  // inserted on all the threads.
+  std::vector<size_t> missing;
+  for (size_t j = 0; j < count; j++)
+    if (!linked[j])
+      missing.push_back(j);
+  if (missing.empty()) {
+    if (dropped > 0 && !set.Graph->Write(path))
+      std::cerr << "Could not save HNSW graph to " << path.string()
+                << std::endl;
+    return;
+  }
+
+  std::cout << "Adding " << missing.size() << " fingerprints of " << set.Spec
+            << " to the HNSW graph..." << std::endl;
+  std::vector<uint32_t> nodes(missing.size());
+  Util::Parallel(missing.size(), Threads, [&](size_t first, size_t last) {
+    for (size_t m = first; m < last; m++)
+      nodes[m] = set.Graph->Insert(
+          set.Coefficients.data() + missing[m] * coefficients,
+          set.Names[missing[m]]);
+  });
+
+  set.GraphFingerprints.resize(set.Graph->Size());
+  for (size_t m = 0; m < missing.size(); m++)
+    set.GraphFingerprints[nodes[m]] = missing[m];
+
+  if (!set.Graph->Write(path))
+    std::cerr << "Could not save HNSW graph to " << path.string() << std::endl;
+}
+
+void FingerprintStore::IndexLists(FingerprintSet &set) {
+  const size_t count = set.Names.size();
+  auto path = StorePath(SrcDirectory, "ivf", set.Spec);
+  set.Lists = std::make_unique<InvertedFile>(set.Dct->Count());
+  bool read = set.Lists->Read(path);
+  if (read && set.Lists->Outgrown(count)) {
+    std::cout << "Store of " << set.Spec << " has outgrown its inverted lists"
+              << std::endl;
+    set.Lists = std::make_unique<InvertedFile>(set.Dct->Count());
+    read = false;
+  }
+  if (!read) {
+    std::cout << "Training inverted lists for " << set.Spec << "..."
+              << std::endl;
+    set.Lists->Train(set.Coefficients.data(), count, Threads);
+    if (!set.Lists->Write(path))
+      std::cerr << "Could not save inverted lists to " << path.string()
+                << std::endl;
+  }
+
+  set.Lists->Assign(set.Coefficients.data(), count, Threads);
+  std::cerr << count << " fingerprints of " << set.Spec << " in "
+            << set.Lists->Lists() << " inverted lists" << std::endl;
+}
+
+void FingerprintStore::IndexCodes(FingerprintSet &set) {
+  const size_t count = set.Names.size();
+  auto path = StorePath(SrcDirectory, "pq", set.Spec);
+  set.Quantiser = std::make_unique<ProductQuantiser>(set.Dct->Count());
+  if (!set.Quantiser->Read(path)) {
+    std::cout << "Training product quantiser for " << set.Spec << "..."
+              << std::endl;
+    set.Quantiser->Train(set.Coefficients.data(), count, Threads);
+    if (!set.Quantiser->Write(path))
+      std::cerr << "Could not save product quantiser to " << path.string()
+                << std::endl;
+  }
+
+  set.Codes.resize(count * set.Quantiser->CodeBytes());
+  set.Quantiser->Encode(set.Coefficients.data(), count, set.Codes.data(),
+                        Threads);
+  std::cerr << count << " fingerprints of " << set.Spec << " in "
+            << set.Quantiser->CodeBytes() << " byte codes" << std::endl;
+}
+
+void FingerprintStore::IndexHashes(FingerprintSet &set, const size_t tables) {
+  const size_t count = set.Names.size();
+  set.Hashes = std::make_unique<LshIndex>(set.Dct->Count(), tables);
+  set.Hashes->Build(set.Coefficients.data(), count, Threads);
+  std::cerr << count << " fingerprints of " << set.Spec << " in " << tables
+            << " hash tables of " << LshIndex::Bits << " bits" << std::endl;
+}
+
+void FingerprintStore::IndexWavelets(FingerprintSet &set) {
+  const size_t count = set.Names.size();
+  size_t width = 0, height = 0;
+  sscanf(set.Spec.c_str(), "%zux%zu", &width, &height);
+  set.Wavelets = std::make_unique<WaveletIndex>(width, height);
+  set.Wavelets->Build(set.Arenas[0].Data(), count, set.Kernel->Stride(),
+                      Threads);
+  std::cerr << count << " fingerprints of " << set.Spec << " in "
+            << WaveletIndex::Kept << " coefficient wavelet signatures"
+            << std::endl;
+}
+
+boost::filesystem::path
+FingerprintStore::StorePath(const std::string &directory,
+                            const std::string &kind, const std::string &spec) {
+  std::string geometry = spec.substr(0, spec.find('!'));
+  return boost::filesystem::path(directory) / ("." + kind + "-" + geometry);
+}
+
+std::unique_ptr<HnswIndex>
+FingerprintStore::ReadGraph(const boost::filesystem::path &path,
+                            const size_t dimensions) {
+  auto graph = std::make_unique<HnswIndex>(dimensions);
+  if (boost::filesystem::exists(path) && !graph->Read(path)) {
+    std::cerr << "Ignoring unreadable HNSW graph " << path.string()
+              << std::endl;
+    graph = std::make_unique<HnswIndex>(dimensions);
+  }
+  return graph;
+}
+
+uint64_t FingerprintStore::Checksum(const FingerprintSet &set,
+                                    const size_t threads) {
+  // A fingerprint regenerated from an edited photo, flipped say, can keep its
+  // name, sums and norm, so its samples are hashed too: a word at a time, as
+  // byte by byte would take longer than building the table again.
+  const size_t samples = set.Kernel->Samples();
+  const size_t stride = set.Kernel->Stride();
+  std::vector<uint64_t> contents(set.Names.size());
+  Util::Parallel(contents.size(), threads, [&](size_t first, size_t last) {
+    for (size_t j = first; j < last; j++) {
+      const uint8_t *fingerprint = set.Arenas[0].Data() + j * stride;
+      uint64_t content = samples;
+      for (size_t k = 0; k < samples; k += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        std::memcpy(&word, fingerprint + k,
+                    std::min(sizeof(word), samples - k));
+        content = (content ^ word) * 0xff51afd7ed558ccdull;
+        content ^= content >> 32;
+      }
+      contents[j] = content;
     }
+  });
 
-    if (distortion < LowDistortionThreshold) {
-      msg << "\tis identical to\t" << fingerprintName << std::endl;
-      std::cout << msg.str() << std::flush;
-      continue;
+  // FNV-1a over the spec and each fingerprint's name, sums, norm and samples'
+  // hash, in order.
+  uint64_t hash = 14695981039346656037ull;
+  auto add = [&](const void *data, const size_t bytes) {
+    for (size_t j = 0; j < bytes; j++) {
+      hash ^= static_cast<const uint8_t *>(data)[j];
+      hash *= 1099511628211ull;
+    }
+  };
+
+  add(set.Spec.data(), set.Spec.size() + 1);
+  for (size_t j = 0; j < set.Names.size(); j++) {
+    add(set.Names[j].data(), set.Names[j].size() + 1);
+    add(set.Sums[j].Sum, sizeof(set.Sums[j].Sum));
+    add(&set.Norms[j], sizeof(set.Norms[j]));
+    add(&contents[j], sizeof(contents[j]));
+  }
+  return hash;
+}
+
+void FingerprintStore::FindMatchesForBatch(
+    const QueryBatch &batch, const size_t setIndex, const PixelArena &arena,
+    const size_t begin, const size_t end, const bool matrixMultiply,
+    std::vector<std::stringstream> &outputs) {
+  const FingerprintSet &set = Sets[setIndex];
+  const DistanceKernel &kernel = *set.Kernel;
+  const uint8_t *queries = batch.Samples[setIndex].Data();
+  const size_t queryCount = batch.Filenames.size();
+  const size_t stride = kernel.Stride();
+
+  // Only the span covering every query's window needs to be read at all.
+  std::vector<std::pair<size_t, size_t>> windows;
+  size_t low = end, high = begin;
+  for (size_t q = 0; q < queryCount; q++) {
+    windows.push_back(MatchWindow(set, batch.Sums[setIndex][q], begin, end));
+    if (windows[q].first < windows[q].second) {
+      low = std::min(low, windows[q].first);
+      high = std::max(high, windows[q].second);
+    }
+  }
+
+  // Without the matrix multiply, each query only goes on to the fingerprints
+  // in its window near enough in colour, the slice of its moment tree hits
+  // falling in the window. Those ruled out that way still count as having
+  // been in the window.
+  uint64_t compared = 0, passed[PruningChecks] = {};
+  std::vector<std::pair<const uint32_t *, const uint32_t *>> nearby(
+      queryCount);
+  if (!matrixMultiply) {
+    for (size_t q = 0; q < queryCount; q++) {
+      const auto &hits = batch.Nearby[setIndex][q];
+      const uint32_t *from = std::lower_bound(
+          hits.data(), hits.data() + hits.size(), windows[q].first);
+      const uint32_t *to = std::lower_bound(
+          from, hits.data() + hits.size(), windows[q].second);
+      nearby[q] = {from, to};
+      passed[WindowCheck] +=
+          windows[q].second - windows[q].first - size_t(to - from);
     }
+  }
+
+  std::vector<uint64_t> distances(queryCount * set.BlockSize);
+  for (size_t first = low; first < high; first += set.BlockSize) {
+    size_t count = std::min(set.BlockSize, high - first);
+    const uint8_t *block = arena.Data() + first * stride;
+
+    // The matrix multiply does the whole block for every query, pruned or
+    // not, as it's no cheaper to leave pairs out. Only the pairs in each
+    // query's window are used, though, so only they count as compared.
+    if (matrixMultiply)
+      kernel.SquaredDistances(queries, batch.Norms[setIndex].data(),
+                              queryCount, block, set.Norms.data() + first,
+                              count, distances.data());
+
+    // Only the first query to reach each fingerprint reads it from memory.
+    for (size_t q = 0; q < queryCount; q++) {
+      if (matrixMultiply) {
+        size_t from = std::max(first, windows[q].first);
+        size_t to = std::min(first + count, windows[q].second);
+        for (size_t f = from; f < to; f++)
+          WriteMatch(batch.Filenames[q], set.Names[f],
+                     distances[q * count + f - first], kernel.Samples(),
+                     outputs[q]);
+        if (from < to) {
+          passed[WindowCheck] += to - from;
+          compared += to - from;
+        }
+        continue;
+      }
+
+      auto &next = nearby[q].first;
+      for (; next != nearby[q].second && *next < first + count; next++) {
+        size_t f = *next;
+        if (!MayMatch(batch, setIndex, q, f, passed))
+          continue;
+        uint64_t sum = kernel.SquaredDistance(queries + q * stride,
+                                              arena.Data() + f * stride);
+        compared++;
+        WriteMatch(batch.Filenames[q], set.Names[f], sum, kernel.Samples(),
+                   outputs[q]);
+      }
+    }
+  }
+
+  for (int check = 0; check < PruningChecks; check++)
+    PairsPassed[check] += passed[check];
+  PairsCompared += compared;
+  PairsTotal += queryCount * (end - begin);
+}
+
+std::pair<size_t, size_t>
+FingerprintStore::MatchWindow(const FingerprintSet &set,
+                              const ChannelSums &query, const size_t begin,
+                              const size_t end) {
+  // The RMSE is at least the difference in means, so a match needs the totals
+  // to differ by less than the threshold times the sample count. One more
+  // allows for rounding, as the window must never miss a match.
+  const size_t samples = set.Kernel->Samples();
+  const uint64_t radius =
+      uint64_t(HighDistortionThreshold * 255.0 * samples) + 1;
+  const uint64_t total = query.Total();
+  const uint64_t lowest = total > radius ? total - radius : 0;
+  const uint64_t highest = total + radius;
+
+  auto first = set.Sums.begin() + begin, last = set.Sums.begin() + end;
+  auto from = std::lower_bound(first, last, lowest, [](auto &sums, auto total) {
+    return sums.Total() < total;
+  });
+  auto to = std::upper_bound(from, last, highest, [](auto total, auto &sums) {
+    return total < sums.Total();
+  });
+  return {from - set.Sums.begin(), to - set.Sums.begin()};
+}
+
+bool FingerprintStore::MayMatch(const QueryBatch &batch, const size_t setIndex,
+                                const size_t query, const size_t fingerprint,
+                                uint64_t passed[PruningChecks]) {
+  const FingerprintSet &set = Sets[setIndex];
+  const size_t samples = set.Kernel->Samples();
+  const double limit = HighDistortionThreshold * 255.0 * std::sqrt(samples);
+  passed[WindowCheck]++;
+
+  // The moments bound the whole sum from below, by the differences in each
+  // channel's mean and in its deviation. Pairs are only ruled out by a clear
+  // margin.
+  double bound =
+      batch.Moments[setIndex][query].SquaredDistance(set.Moments[fingerprint]);
+  if (bound >= limit * limit * (1 + RoundingMargin))
+    return false;
+  passed[MomentsCheck]++;
+
+  const uint8_t *thumbnail =
+      batch.Thumbnails[setIndex].data() + query * TinyImages::Bytes;
+  if (set.Tiny->Distance(thumbnail, set.Tiny->Image(fingerprint)) >
+      set.TinyThreshold)
+    return false;
+  passed[TinyCheck]++;
+
+  // The pivot bounds are distances, not squared.
+  const size_t pivots = set.Pivots.Pivots().size();
+  bound = set.Pivots.LowerBound(
+      batch.PivotDistances[setIndex].data() + query * pivots, fingerprint);
+  if (bound >= limit * (1 + RoundingMargin))
+    return false;
+  passed[PivotCheck]++;
+
+  const size_t count = set.Dct->Count();
+  bound = set.Dct->SquaredDistance(
+      batch.Coefficients[setIndex].data() + query * count,
+      set.Coefficients.data() + fingerprint * count);
+  if (bound >= limit * limit * (1 + RoundingMargin))
+    return false;
+  passed[DctCheck]++;
+  return true;
+}
+
+ChannelSums FingerprintStore::SumChannels(const uint8_t *samples,
+                                          const size_t count) {
+  ChannelSums sums = {{0, 0, 0}};
+  for (size_t j = 0; j < count; j++)
+    sums.Sum[j % 3] += samples[j];
+  return sums;
+}
+
+void FingerprintStore::FindApproximateMatches(
+    const QueryBatch &batch, const size_t setIndex, const size_t query,
+    const PixelArena &arena, const ApproximateSearch &approximate,
+    std::stringstream &output) {
+  const FingerprintSet &set = Sets[setIndex];
+  const DistanceKernel &kernel = *set.Kernel;
+  const size_t stride = kernel.Stride();
+  const uint8_t *samples = batch.Samples[setIndex].Data() + query * stride;
+  const float *coefficients =
+      batch.Coefficients[setIndex].data() + query * set.Dct->Count();
+
+  std::vector<size_t> candidates;
+  if (approximate.Breadth > 0) {
+    for (auto &nearest : set.Graph->Search(coefficients, approximate.Breadth))
+      candidates.push_back(set.GraphFingerprints[nearest.second]);
+  }
+
+  // The lists hold everything near their centroids, so most of it is still
+  // worth ruling out by the exact checks before comparing in full.
+  uint64_t passed[PruningChecks] = {};
+  if (approximate.Probes > 0) {
+    auto lists = set.Lists->NearestLists(coefficients, approximate.Probes);
+    for (auto list : lists) {
+      auto entries = set.Lists->List(list);
+      for (auto entry = entries.first; entry != entries.second; entry++)
+        if (MayMatch(batch, setIndex, query, *entry, passed))
+          candidates.push_back(*entry);
+    }
+  }
+
+  // Every code in the query's window is scanned, keeping the nearest few.
+  if (approximate.Shortlist > 0) {
+    const ProductQuantiser &quantiser = *set.Quantiser;
+    std::vector<float> table(quantiser.TableSize());
+    quantiser.DistanceTable(coefficients, table.data());
+
+    std::priority_queue<std::pair<float, size_t>> nearest;
+    auto window =
+        MatchWindow(set, batch.Sums[setIndex][query], 0, set.Names.size());
+    for (size_t f = window.first; f < window.second; f++) {
+      float distance = quantiser.Distance(
+          table.data(), set.Codes.data() + f * quantiser.CodeBytes());
+      if (nearest.size() < approximate.Shortlist) {
+        nearest.push({distance, f});
+      } else if (distance < nearest.top().first) {
+        nearest.pop();
+        nearest.push({distance, f});
+      }
+    }
+
+    for (; !nearest.empty(); nearest.pop())
+      candidates.push_back(nearest.top().second);
+  }
+
+  // Buckets are as loose as the lists, so are screened the same way.
+  if (approximate.Tables > 0) {
+    for (auto fingerprint : set.Hashes->Candidates(coefficients))
+      if (MayMatch(batch, setIndex, query, fingerprint, passed))
+        candidates.push_back(fingerprint);
+  }
+
+  if (approximate.Scored > 0) {
+    for (auto fingerprint : set.Wavelets->Nearest(samples, approximate.Scored))
+      candidates.push_back(fingerprint);
+  }
+
+  // Candidates are taken in store order, like the exact matches, and only
+  // once each however many ways they were found.
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                   candidates.end());
+
+  std::vector<size_t> matches;
+  for (auto fingerprint : candidates) {
+    uint64_t sum =
+        kernel.SquaredDistance(samples, arena.Data() + fingerprint * stride);
+    if (WriteMatch(batch.Filenames[query], set.Names[fingerprint], sum,
+                   kernel.Samples(), output))
+      matches.push_back(fingerprint);
+  }
+
+  if (ApproximateSearches++ % RecallInterval != 0)
+    return;
 
-    if (distortion < HighDistortionThreshold) {
-      msg << "\tis similar to\t" << fingerprintName << std::endl;
-      std::cout << msg.str() << std::flush;
+  // The exact matches, found the same way as without the indexes.
+  uint64_t expected = 0, found = 0;
+  auto window =
+      MatchWindow(set, batch.Sums[setIndex][query], 0, set.Names.size());
+  for (size_t f = window.first; f < window.second; f++) {
+    if (!MayMatch(batch, setIndex, query, f, passed))
       continue;
+    uint64_t sum = kernel.SquaredDistance(samples, arena.Data() + f * stride);
+    if (Distortion(sum, kernel.Samples()) < HighDistortionThreshold) {
+      expected++;
+      found += std::binary_search(matches.begin(), matches.end(), f);
     }
   }
+
+  RecallChecks++;
+  RecallExpected += expected;
+  RecallFound += found;
+}
+
+double FingerprintStore::Distortion(const uint64_t squaredDistance,
+                                    const size_t samples) {
+  return std::sqrt(double(squaredDistance) / samples) / 255.0;
+}
+
+bool FingerprintStore::WriteMatch(const std::string &filename,
+                                  const std::string &name,
+                                  const uint64_t squaredDistance,
+                                  const size_t samples,
+                                  std::stringstream &output) {
+  auto distortion = Distortion(squaredDistance, samples);
+
+  if (distortion < LowDistortionThreshold) {
+    output << filename << "\tis identical to\t" << name << std::endl;
+    return true;
+  }
+
+  if (distortion < HighDistortionThreshold) {
+    output << filename << "\tis similar to\t" << name << std::endl;
+    return true;
+  }
+  return false;
 }
 
 void FingerprintStore::RunWorkers(const WorkerOptions options) {
   // Start asynchronous traversal of directory.
   DirectoryWalker *dw;
   if (options.WType == GenerateWorker) {
-    dw = new DirectoryWalker(SrcDirectory);
+    dw = new DirectoryWalker(SrcDirectory, options.Ordered);
   } else {
-    dw = new DirectoryWalker(options.DstDirectory);
+    dw = new DirectoryWalker(options.DstDirectory, options.Ordered);
   }
   dw->Traverse(true);
 
+  // Shared between all workers so that the total decoded pixel memory stays
+  // under the configured ceiling.
+  MemoryBudget budget(options.MemoryLimit);
+
+  // All results go through the sink, which can put them back in walk order.
+  OutputSink sink(options.Ordered, OrderedOutputWindow);
+
+  // Reader stage, which reads whole files ahead of the workers when enabled.
+  FileReader reader(dw, &sink, options.QueueDepth, options.MapFiles);
+  reader.Start();
+
+  // Times every decode, and abandons those that take too long.
+  DecodeWatchdog watchdog(options.DecodeTimeout);
+  watchdog.Start();
+
+  // Comparisons split up by duplicate finding workers, for any of them to run.
+  TaskQueue tasks(options.NumThreads);
+
+  // When asked to, generated fingerprints are added to the store's graph for
+  // their geometry as they are made, and it is saved once they are all done.
+  // They are also offered as a sample to train the inverted lists on, unless
+  // the store already has them (which are trained again on loading once the
+  // store has outgrown them).
+  std::unique_ptr<HnswIndex> graph;
+  std::unique_ptr<InvertedFile> lists;
+  boost::filesystem::path graphPath, listsPath;
+  if (options.WType == GenerateWorker && options.IndexGenerated) {
+    unsigned int width = 0, height = 0;
+    sscanf(options.GenerateSpec.c_str(), "%ux%u", &width, &height);
+    size_t dimensions = CompactDct(width, height, 3).Count();
+    graphPath = StorePath(options.DstDirectory, "hnsw", options.GenerateSpec);
+    graph = ReadGraph(graphPath, dimensions);
+    listsPath = StorePath(options.DstDirectory, "ivf", options.GenerateSpec);
+    lists = std::make_unique<InvertedFile>(dimensions);
+    if (lists->Read(listsPath))
+      lists.reset();
+  }
+
+  WorkerContext context = {&reader, &budget, &sink,        &watchdog,
+                           &tasks,  graph.get(), lists.get()};
+
+  // Each worker is assigned a node round-robin. Without NUMA awareness
+  // everything runs on the one "node" covering the whole machine.
+  std::vector<std::vector<int>> nodes;
+  if (options.Numa)
+    nodes = Numa::Nodes();
+  if (nodes.size() > 1 && options.WType == FingerprintWorker)
+    ReplicateAcrossNodes(nodes);
+  if (options.Numa)
+    std::cerr << "Using " << nodes.size() << " NUMA node(s)" << std::endl;
+
   // Spawn threads for the actual fingerprint generation
   std::vector<std::thread> threads;
   for (int i = 0; i < options.NumThreads; i++) {
     std::thread thread;
+    const std::vector<int> *cpus =
+        nodes.empty() ? nullptr : &nodes[i % nodes.size()];
+    const size_t node = nodes.empty() ? 0 : i % nodes.size();
 
     // Use the power of filthy lambdas to start the things.
     switch (options.WType) {
     case GenerateWorker:
-      thread = std::thread([=] { Generate(dw, options.DstDirectory); });
+      thread = std::thread([=] {
+        if (cpus)
+          Numa::PinCurrentThread(*cpus);
+        Generate(context, options.DstDirectory, options.GenerateSpec);
+      });
       break;
     case MetadataWorker:
-      thread = std::thread([=] { ExtractMetadata(dw); });
+      thread = std::thread([=] {
+        if (cpus)
+          Numa::PinCurrentThread(*cpus);
+        ExtractMetadata(context);
+      });
       break;
     case FingerprintWorker:
-      thread = std::thread([=] { FindDuplicates(dw, options.FuzzFactor); });
+      thread = std::thread([=] {
+        if (cpus)
+          Numa::PinCurrentThread(*cpus);
+        FindDuplicates(context, node, options.BatchSize,
+                       options.MatrixMultiply, options.Approximate);
+      });
       break;
     }
 
@@ -130,80 +831,257 @@ void FingerprintStore::RunWorkers(const WorkerOptions options) {
       threads[i].join();
   }
 
-  // Wait also on the directory traversal thread to complete.
+  // Wait also on the reader and directory traversal threads to complete.
+  reader.Finish();
   dw->Finish();
   delete dw;
-}
+  watchdog.Finish();
 
-void FingerprintStore::FindDuplicates(DirectoryWalker *dw,
-                                      const int fuzzFactor) {
-  while (true) {
-    auto next = dw->GetNext();
-    std::optional<boost::filesystem::path> entry = next.first;
-    bool completed = next.second;
+  if (graph && !graph->Write(graphPath))
+    std::cerr << "Could not save HNSW graph to " << graphPath.string()
+              << std::endl;
+  if (lists) {
+    lists->Train(options.NumThreads);
+    if (lists->Lists() > 0 && !lists->Write(listsPath))
+      std::cerr << "Could not save inverted lists to " << listsPath.string()
+                << std::endl;
+  }
 
-    // No next value as the directory traversal has completed.
-    if (!entry.has_value() && completed)
-      break;
+  std::cerr << "Rejected " << reader.Rejected()
+            << " files by their header, and " << DecodeFailures
+            << " more failed to decode" << std::endl;
+  // The matrix multiply compares everything in the windows, and prunes no
+  // further.
+  if (options.WType == FingerprintWorker && PairsTotal > 0 &&
+      options.MatrixMultiply)
+    std::cerr << "Of " << PairsTotal << " image and fingerprint pairs, "
+              << PairsCompared << " were in brightness windows and compared "
+              << "by matrix multiply" << std::endl;
+  else if (options.WType == FingerprintWorker && PairsTotal > 0)
+    std::cerr << "Of " << PairsTotal << " image and fingerprint pairs, "
+              << PairsPassed[WindowCheck] << " were in brightness windows, "
+              << PairsPassed[MomentsCheck] << " passed their colour moments, "
+              << PairsPassed[TinyCheck] << " their thumbnails, "
+              << PairsPassed[PivotCheck] << " their pivot distances and "
+              << PairsPassed[DctCheck] << " their DCT coefficients; "
+              << PairsCompared << " were compared pixel by pixel"
+              << std::endl;
+  if (options.WType == FingerprintWorker && options.Approximate.Enabled()) {
+    std::cerr << "Matches are approximate, from "
+              << options.Approximate.Describe() << ". ";
+    if (RecallExpected > 0)
+      std::cerr << "Estimated recall " << std::fixed << std::setprecision(1)
+                << 100.0 * RecallFound / RecallExpected << "%: found "
+                << RecallFound << " of " << RecallExpected << " matches for "
+                << RecallChecks << " images checked against every fingerprint"
+                << std::endl;
+    else
+      std::cerr << "No recall estimate, as none of the " << RecallChecks
+                << " images checked against every fingerprint had matches"
+                << std::endl;
+  }
+}
 
-    // We may not have an entry, but if directory traversal hasn't completed, we
-    // should wait for the next one.
-    if (!entry.has_value() && !completed) {
-      sleep(1);
-      continue;
-    }
+void FingerprintStore::FindDuplicates(WorkerContext context,
+                                      const size_t node,
+                                      const size_t batchSize,
+                                      const bool matrixMultiply,
+                                      const ApproximateSearch &approximate) {
+  // Queries resized for each set, aligned the same way as the fingerprints for
+  // the kernel.
+  QueryBatch batch;
+  for (auto &set : Sets) {
+    batch.Samples.emplace_back(set.Kernel->Stride() * batchSize);
+    batch.Norms.emplace_back(batchSize);
+    batch.Sums.emplace_back(batchSize);
+    batch.Moments.emplace_back(batchSize);
+    batch.Nearby.emplace_back(batchSize);
+    batch.Thumbnails.emplace_back(TinyImages::Bytes * batchSize);
+    batch.PivotDistances.emplace_back(set.Pivots.Pivots().size() * batchSize);
+    batch.Coefficients.emplace_back(set.Dct->Count() * batchSize);
+  }
 
-    // Filter only known image suffixes
-    if (!Util::IsSupportedImage(entry.value()))
+  while (auto file = context.Reader->GetNext()) {
+    // A link is identical to the file it links to, which has been (or will
+    // be) compared already. The batch is flushed first, as ordered output
+    // could otherwise wait on this worker's own incomplete queries.
+    if (!file->AliasOf.empty()) {
+      std::stringstream output;
+      output << file->Path.string() << "\tis the same file as\t"
+             << file->AliasOf.string() << std::endl;
+      uint64_t sequence = file->Sequence;
+      file.reset();
+      CompareBatch(context, batch, node, matrixMultiply, approximate);
+      context.Sink->Complete(sequence, output.str());
       continue;
+    }
 
-    // Read in one image, resize it to comparison specifications
-    auto filename = entry.value().string();
+    // Read in one image, resize it to comparison specifications. Each set's
+    // copy is resized from the full image, the same way Generate made them.
+    auto filename = file->Path.string();
+    size_t slot = batch.Filenames.size();
     Magick::Image image;
     try {
-      image.read(filename);
+      auto reservation = ReserveDecode(context.Budget, *file);
+      DecodeWatchdog::Watch watch(context.Watchdog, filename);
+      Decode(*file, image, &watch);
+      image.compressType(
+          MagickCore::CompressionType::NoCompression); // may not be needed
+      for (size_t i = 0; i < Sets.size(); i++) {
+        const DistanceKernel &kernel = *Sets[i].Kernel;
+        const CompactDct &dct = *Sets[i].Dct;
+        const auto &pivots = Sets[i].Pivots.Pivots();
+        const PixelArena &arena = Sets[i].Arenas[node % Sets[i].Arenas.size()];
+        uint8_t *samples = batch.Samples[i].Data() + slot * kernel.Stride();
+        Magick::Image resized(image);
+        Resize(resized, Sets[i].Spec, &watch);
+        ExportSamples(resized, samples);
+        batch.Norms[i][slot] = kernel.SquaredNorm(samples);
+        batch.Sums[i][slot] = SumChannels(samples, kernel.Samples());
+        batch.Moments[i][slot] = ColourMoments::Of(samples, kernel.Samples());
+        if (!matrixMultiply && !approximate.Enabled()) {
+          // Searched here, once per query, rather than by each range task.
+          const double limit =
+              HighDistortionThreshold * 255.0 * std::sqrt(kernel.Samples());
+          auto &nearby = batch.Nearby[i][slot];
+          nearby.clear();
+          Sets[i].MomentIndex.Within(batch.Moments[i][slot],
+                                     limit * limit * (1 + RoundingMargin),
+                                     nearby);
+          std::sort(nearby.begin(), nearby.end());
+        }
+        Sets[i].Tiny->Shrink(samples, batch.Thumbnails[i].data() +
+                                          slot * TinyImages::Bytes);
+        for (size_t p = 0; p < pivots.size(); p++)
+          batch.PivotDistances[i][slot * pivots.size() + p] =
+              std::sqrt(float(kernel.SquaredDistance(
+                  samples, arena.Data() + pivots[p] * kernel.Stride())));
+        dct.Transform(samples,
+                      batch.Coefficients[i].data() + slot * dct.Count());
+      }
     } catch (const std::exception &e) {
       // silently skip unreadable file for the moment
+      DecodeFailures++;
+      context.Sink->Skip(file->Sequence);
       continue;
     }
-    image.compressType(
-        MagickCore::CompressionType::NoCompression); // may not be needed
-    image.resize(FingerprintSpec);
 
-    // Compare
-    FindMatchesForImage(image, filename, fuzzFactor);
+    batch.Filenames.push_back(filename);
+    batch.Sequences.push_back(file->Sequence);
+
+    // The file's buffer goes back to the reader before comparing, which in
+    // ordered mode can wait on output. Waiting workers holding every buffer
+    // would starve the worker with the oldest entry in its batch.
+    file.reset();
+    if (batch.Filenames.size() == batchSize)
+      CompareBatch(context, batch, node, matrixMultiply, approximate);
   }
+
+  CompareBatch(context, batch, node, matrixMultiply, approximate);
+
+  // Then help the other workers with their comparisons until they are done.
+  context.Tasks->RemoveProducer();
+  context.Tasks->RunUntilDrained(node);
 }
 
-void FingerprintStore::Generate(DirectoryWalker *dw,
-                                const std::string dstDirectory) {
-  boost::filesystem::path dest(dstDirectory);
+void FingerprintStore::CompareBatch(WorkerContext context, QueryBatch &batch,
+                                    const size_t node,
+                                    const bool matrixMultiply,
+                                    const ApproximateSearch &approximate) {
+  const size_t queryCount = batch.Filenames.size();
+  if (queryCount == 0)
+    return;
 
-  // Iterate through all files in the directory
-  while (true) {
-    auto next = dw->GetNext();
-    std::optional<boost::filesystem::path> entry = next.first;
-    bool completed = next.second;
+  // Every task writes its own outputs, which are put back together in
+  // fingerprint order so the results don't depend on who ran what.
+  struct Range {
+    size_t Set, First, Last;
+  };
+  std::vector<Range> ranges;
+  std::vector<std::vector<std::stringstream>> outputs;
+  std::atomic<size_t> remaining(0);
+  std::vector<TaskQueue::Task> tasks;
 
-    // No next value as the directory traversal has completed.
-    if (!entry.has_value() && completed)
-      break;
+  if (approximate.Enabled()) {
+    // Approximate searches are separate for each query in each set. Any
+    // worker can pick one up, using its own node's arena to check the
+    // candidates.
+    outputs.resize(Sets.size());
+    for (size_t i = 0; i < Sets.size(); i++) {
+      outputs[i].resize(queryCount);
+      for (size_t q = 0; q < queryCount; q++) {
+        tasks.push_back([&, i, q](const size_t taskNode) {
+          const FingerprintSet &set = Sets[i];
+          FindApproximateMatches(batch, i, q,
+                                 set.Arenas[taskNode % set.Arenas.size()],
+                                 approximate, outputs[i][q]);
+          remaining--;
+        });
+      }
+    }
+  } else {
+    // Each set is split into ranges of whole cache blocks, up to one per
+    // worker, so that even a single query against a large store is spread
+    // over every thread. Any worker can pick up a range, using its own
+    // node's arena.
+    for (size_t i = 0; i < Sets.size(); i++) {
+      size_t count = Sets[i].Names.size();
+      size_t blocks = (count + Sets[i].BlockSize - 1) / Sets[i].BlockSize;
+      size_t parts = std::min(blocks, context.Tasks->Workers());
+      for (size_t part = 0; part < parts; part++)
+        ranges.push_back(
+            {i, count * part / parts, count * (part + 1) / parts});
+    }
 
-    // We may not have an entry, but if directory traversal hasn't completed, we
-    // should wait for the next one.
-    if (!entry.has_value() && !completed) {
-      sleep(1);
-      continue;
+    outputs.resize(ranges.size());
+    for (size_t r = 0; r < ranges.size(); r++) {
+      outputs[r].resize(queryCount);
+      tasks.push_back([&, r](const size_t taskNode) {
+        const Range &range = ranges[r];
+        const FingerprintSet &set = Sets[range.Set];
+        FindMatchesForBatch(batch, range.Set,
+                            set.Arenas[taskNode % set.Arenas.size()],
+                            range.First, range.Last, matrixMultiply,
+                            outputs[r]);
+        remaining--;
+      });
     }
+  }
+
+  // This worker helps with its own tasks (and anything else queued) until
+  // they are all done, so it is the one to complete the batch on the sink.
+  remaining = tasks.size();
+  context.Tasks->Push(std::move(tasks));
+  context.Tasks->RunUntil(node, [&] { return remaining == 0; });
+
+  for (size_t q = 0; q < queryCount; q++) {
+    std::string output;
+    for (auto &part : outputs)
+      output += part[q].str();
+    context.Sink->Complete(batch.Sequences[q], output);
+  }
+
+  batch.Filenames.clear();
+  batch.Sequences.clear();
+}
 
-    // Filter only known image suffixes
-    if (!Util::IsSupportedImage(entry.value()))
+void FingerprintStore::Generate(WorkerContext context,
+                                const std::string dstDirectory,
+                                const std::string spec) {
+  boost::filesystem::path dest(dstDirectory);
+
+  // Iterate through all files in the directory
+  while (auto file = context.Reader->GetNext()) {
+    // One fingerprint per physical file is enough.
+    if (!file->AliasOf.empty()) {
+      context.Sink->Skip(file->Sequence);
       continue;
+    }
 
     std::stringstream msg;
-    msg << entry.value().string() << std::endl;
-    std::cout << msg.str() << std::flush;
-    auto filename = entry.value().filename().replace_extension(
+    msg << file->Path.string() << std::endl;
+    context.Sink->Complete(file->Sequence, msg.str());
+    auto filename = file->Path.filename().replace_extension(
         ".tif"); // save fingerprints uncompressed
     Magick::Image image;
 
@@ -212,62 +1090,70 @@ void FingerprintStore::Generate(DirectoryWalker *dw,
       auto outputFilename = boost::filesystem::path(dest);
       outputFilename += filename;
 
-      image.read(entry.value().string());
+      auto reservation = ReserveDecode(context.Budget, *file);
+      DecodeWatchdog::Watch watch(context.Watchdog, file->Path.string());
+      Decode(*file, image, &watch);
       image.defineValue("quantum", "format",
                         "floating-point"); // fix HDRI comparison issues
       image.depth(32);                     // also for the HDRI stuff
       image.compressType(
           MagickCore::CompressionType::NoCompression); // may not be needed
-      image.resize(FingerprintSpec);
-      image.attribute("comment", entry.value().string());
+      Resize(image, spec, &watch);
+      reservation.Release();
+      image.attribute("comment", file->Path.string());
       image.write(outputFilename.string());
+
+      // The graph gets the same 8-bit samples the fingerprint will be loaded
+      // as, transformed the same way as when loading.
+      if (context.Graph) {
+        CompactDct dct(image.columns(), image.rows(), 3);
+        std::vector<uint8_t> samples(image.columns() * image.rows() * 3);
+        std::vector<float> coefficients(dct.Count());
+        ExportSamples(image, samples.data());
+        dct.Transform(samples.data(), coefficients.data());
+        if (dct.Count() == context.Graph->Dimensions()) {
+          context.Graph->Insert(coefficients.data(), file->Path.string());
+          if (context.Lists)
+            context.Lists->Sample(coefficients.data());
+        }
+      }
     } catch (const std::exception &e) {
       // Some already seen:
       // Magick::ErrorCorruptImage
       // Magick::ErrorMissingDelegate
       // Magick::ErrorCoder
       // Magick::WarningImage
+      DecodeFailures++;
       std::stringstream msg;
-      msg << "skipping " << entry.value().string() << " " << e.what()
+      msg << "skipping " << file->Path.string() << " " << e.what()
           << std::endl;
       std::cerr << msg.str() << std::flush;
     }
   }
 }
 
-void FingerprintStore::ExtractMetadata(DirectoryWalker *dw) {
+void FingerprintStore::ExtractMetadata(WorkerContext context) {
   // Iterate through all files in the directory
-  while (true) {
-    auto next = dw->GetNext();
-    std::optional<boost::filesystem::path> entry = next.first;
-    bool completed = next.second;
-
-    // No next value as the directory traversal has completed.
-    if (!entry.has_value() && completed)
-      break;
+  while (auto file = context.Reader->GetNext()) {
+    std::stringstream msg;
 
-    // We may not have an entry, but if directory traversal hasn't completed, we
-    // should wait for the next one.
-    if (!entry.has_value() && !completed) {
-      sleep(1);
+    // The metadata of a link is that of the file it links to.
+    if (!file->AliasOf.empty()) {
+      context.Sink->Skip(file->Sequence);
       continue;
     }
 
-    // Filter only known image suffixes
-    if (!Util::IsSupportedImage(entry.value()))
-      continue;
-
     try {
       Magick::Image image;
-      std::string filename = entry.value().string();
-      image.read(filename);
+      std::string filename = file->Path.string();
+      auto reservation = ReserveDecode(context.Budget, *file);
+      DecodeWatchdog::Watch watch(context.Watchdog, filename);
+      Decode(*file, image, &watch);
       std::string createdAt = image.attribute("exif:DateTimeOriginal");
 
       if (createdAt != "") {
         std::string timestamp = ConvertExifTimestamp(createdAt);
-        std::stringstream msg;
         msg << filename << "\t" << timestamp << std::endl;
-        std::cout << msg.str() << std::flush;
       }
     } catch (const std::exception &e) {
       // Some already seen:
@@ -277,10 +1163,125 @@ void FingerprintStore::ExtractMetadata(DirectoryWalker *dw) {
       // Magick::WarningImage
       // Don't bother printing anything as we might run into all kinds of files
       // we can't read.
+      DecodeFailures++;
     }
+
+    context.Sink->Complete(file->Sequence, msg.str());
   }
 }
 
+void FingerprintStore::ReplicateAcrossNodes(
+    const std::vector<std::vector<int>> &nodes) {
+  for (auto &set : Sets) {
+    const PixelArena &original = set.Arenas[0];
+    std::vector<PixelArena> replicas(nodes.size());
+
+    // The copy is made from a thread pinned to the node, so the first touch
+    // of each page (and therefore its placement) happens there.
+    std::vector<std::thread> threads;
+    for (size_t node = 0; node < nodes.size(); node++) {
+      threads.push_back(std::thread([&, node] {
+        Numa::PinCurrentThread(nodes[node]);
+        replicas[node] = PixelArena(original.Size());
+        std::memcpy(replicas[node].Data(), original.Data(), original.Size());
+      }));
+    }
+
+    for (auto &thread : threads)
+      thread.join();
+
+    set.Arenas = std::move(replicas);
+  }
+}
+
+void FingerprintStore::ExportSamples(Magick::Image &image, uint8_t *samples) {
+  image.write(0, 0, image.columns(), image.rows(), "RGB", Magick::CharPixel,
+              samples);
+}
+
+void FingerprintStore::Decode(const ImageFile &file, Magick::Image &image,
+                              DecodeWatchdog::Watch *watch) {
+  if (file.Data == nullptr) {
+    if (watch)
+      watch->Monitor(image.imageInfo());
+    image.read(MagickFilename(file));
+  } else {
+    image = DecodeInPlace(file, false, watch);
+  }
+
+  if (watch)
+    watch->Check();
+}
+
+void FingerprintStore::Resize(Magick::Image &image, const std::string spec,
+                              DecodeWatchdog::Watch *watch) {
+  if (watch)
+    watch->Monitor(image.image());
+  image.resize(spec);
+
+  if (watch)
+    watch->Check();
+}
+
+Magick::Image FingerprintStore::DecodeInPlace(const ImageFile &file,
+                                              const bool ping,
+                                              DecodeWatchdog::Watch *watch) {
+  // Magick::Blob would take a copy of the file, so go through MagickCore to
+  // decode straight out of the reader's buffer or mapping. The filename only
+  // names the format.
+  MagickCore::ImageInfo *info = MagickCore::CloneImageInfo(nullptr);
+  MagickCore::CopyMagickString(info->filename, MagickFilename(file).c_str(),
+                               MagickCore::MagickPathExtent);
+  if (watch)
+    watch->Monitor(info);
+  MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+
+  MagickCore::Image *images =
+      ping ? MagickCore::PingBlob(info, file.Data, file.Size, exception)
+           : MagickCore::BlobToImage(info, file.Data, file.Size, exception);
+  MagickCore::DestroyImageInfo(info);
+
+  // Only the first frame is used, the same as Magick::Image::read.
+  MagickCore::Image *first = MagickCore::RemoveFirstImageFromList(&images);
+  if (images != nullptr)
+    MagickCore::DestroyImageList(images);
+
+  try {
+    Magick::throwException(exception);
+  } catch (...) {
+    if (first != nullptr)
+      MagickCore::DestroyImageList(first);
+    MagickCore::DestroyExceptionInfo(exception);
+    throw;
+  }
+  MagickCore::DestroyExceptionInfo(exception);
+
+  if (first == nullptr)
+    throw std::runtime_error("no image decoded from " + file.Path.string());
+  return Magick::Image(first);
+}
+
+std::string FingerprintStore::MagickFilename(const ImageFile &file) {
+  if (file.Format.empty())
+    return file.Path.string();
+  return file.Format + ":" + file.Path.string();
+}
+
+MemoryBudget::Reservation
+FingerprintStore::ReserveDecode(MemoryBudget *budget, const ImageFile &file) {
+  if (!budget->Enabled())
+    return MemoryBudget::Reservation();
+
+  // Pinging only reads the header, so this is cheap compared to the decode.
+  Magick::Image header;
+  if (file.Data == nullptr)
+    header.ping(MagickFilename(file));
+  else
+    header = DecodeInPlace(file, true, nullptr);
+  return budget->Reserve(
+      MemoryBudget::EstimateDecodeBytes(header.columns(), header.rows()));
+}
+
 std::string
 FingerprintStore::ConvertExifTimestamp(const std::string timestamp) {
   // https://en.cppreference.com/w/cpp/io/manip/get_time
@@ -1,38 +1,319 @@
 #include "Magick++.h"
+#include <atomic>
+#include <memory>
+#include <sstream>
 #include <vector>
 
 enum WorkerType { GenerateWorker, MetadataWorker, FingerprintWorker };
 
+// Indexes to find each query's candidate matches with, instead of comparing
+// it with every fingerprint. Candidates from all of those used are checked
+// in full, so every match reported is real, but some may be missed.
+struct ApproximateSearch {
+  unsigned int Breadth = 0;   // HNSW candidates per query, 0 not to use it
+  unsigned int Probes = 0;    // inverted lists scanned per query, 0 not to
+  unsigned int Shortlist = 0; // nearest by product quantised codes checked
+  unsigned int Tables = 0;    // random projection hash tables looked in
+  unsigned int Scored = 0;    // best by wavelet signature checked
+
+  bool Enabled() const {
+    return Breadth > 0 || Probes > 0 || Shortlist > 0 || Tables > 0 ||
+           Scored > 0;
+  }
+
+  // e.g. "HNSW searches of breadth 64"
+  std::string Describe() const;
+};
+
 struct WorkerOptions {
   int NumThreads;
   int FuzzFactor;
   std::string DstDirectory;
   WorkerType WType;
+  size_t MemoryLimit;         // decoded pixel bytes in flight, 0 no limit
+  bool Numa;                  // copy fingerprints per NUMA node, pin workers
+  unsigned int QueueDepth;    // files read ahead per batch, 0 to disable
+  bool MapFiles;              // mmap files ahead instead of reading them
+  bool Ordered;               // write results in (sorted) walk order
+  unsigned int DecodeTimeout; // seconds before a decode is abandoned, 0 never
+  std::string GenerateSpec;   // geometry of generated fingerprints
+  unsigned int BatchSize;     // query images compared together
+  bool MatrixMultiply;        // compare batches as a matrix multiply
+  bool IndexGenerated;        // add generated fingerprints to the indexes
+  ApproximateSearch Approximate; // candidate search, if not exact
+};
+
+// Everything shared between the workers of one run.
+struct WorkerContext {
+  FileReader *Reader;
+  MemoryBudget *Budget;
+  OutputSink *Sink;
+  DecodeWatchdog *Watchdog;
+  TaskQueue *Tasks;
+  HnswIndex *Graph;    // generated fingerprints are added to the graph,
+  InvertedFile *Lists; // and offered to train inverted lists, if any
+};
+
+// Per-channel sums of a fingerprint's RGB samples. The RMSE between two
+// fingerprints is at least the difference of their means, overall and (more
+// tightly) channel by channel, so these rule out most pairs without reading
+// any pixels.
+struct ChannelSums {
+  uint32_t Sum[3];
+
+  uint64_t Total() const { return uint64_t(Sum[0]) + Sum[1] + Sum[2]; }
+};
+
+// The checks a query and fingerprint pair must pass, cheapest first, before
+// they're compared sample by sample. Each is exact, never ruling out a match.
+enum PruningCheck {
+  WindowCheck,  // totals close enough to be in the query's window
+  MomentsCheck, // per-channel means and deviations
+  TinyCheck,    // 8x8 grayscale thumbnails
+  PivotCheck,   // distances to the pivots
+  DctCheck,     // low frequency DCT coefficients
+  PruningChecks
+};
+
+// All the fingerprints of one geometry. A store can hold fingerprints generated
+// at several resolutions; each set is compared separately, against the query
+// image resized to its geometry.
+struct FingerprintSet {
+  // Geometry specification to resize queries with, e.g. "100x100!".
+  std::string Spec;
+
+  // Comparison kernel for the geometry, specialised when one is compiled in.
+  // Fingerprints are Kernel->Stride() bytes apart in the arenas.
+  std::unique_ptr<DistanceKernel> Kernel;
+
+  // One arena per NUMA node when running NUMA-aware, otherwise just the one.
+  // Fingerprints are sorted by their total sample sum, so those that could
+  // match a query are a contiguous window found by binary search.
+  std::vector<PixelArena> Arenas;
+  std::vector<std::string> Names;
+  std::vector<ChannelSums> Sums;
+
+  // Colour moments of each fingerprint, and a tree to find those near a
+  // query's.
+  std::vector<ColourMoments> Moments;
+  MomentTree MomentIndex;
+
+  // Thumbnails of the fingerprints, and the largest difference between a
+  // query's and a fingerprint's that could still be a match.
+  std::unique_ptr<TinyImages> Tiny;
+  uint32_t TinyThreshold = 0;
+
+  // Distances from each fingerprint to the set's pivots.
+  PivotTable Pivots;
+
+  // Low frequency DCT coefficients of each fingerprint, Dct->Count() apart,
+  // to rule out the pairs that get past their moments.
+  std::unique_ptr<CompactDct> Dct;
+  std::vector<float> Coefficients;
+
+  // Graph over the coefficients for approximate search, when asked for, and
+  // the fingerprint of each of its nodes.
+  std::unique_ptr<HnswIndex> Graph;
+  std::vector<size_t> GraphFingerprints;
+
+  // Inverted lists of the fingerprints by their coefficients, when asked for.
+  std::unique_ptr<InvertedFile> Lists;
+
+  // Product quantised codes of the coefficients, Quantiser->CodeBytes()
+  // apart, when asked for.
+  std::unique_ptr<ProductQuantiser> Quantiser;
+  std::vector<uint8_t> Codes;
+
+  // Random projection hash tables of the coefficients, when asked for.
+  std::unique_ptr<LshIndex> Hashes;
+
+  // Wavelet signatures of the fingerprints, when asked for.
+  std::unique_ptr<WaveletIndex> Wavelets;
+
+  // Squared norm of each fingerprint, for batched comparisons.
+  std::vector<uint64_t> Norms;
+
+  // Fingerprints per block in batched comparisons: as many as fit in half of
+  // the L2 cache, leaving room for the queries.
+  size_t BlockSize = 1;
+};
+
+// Query images decoded by one worker and waiting to be compared together.
+struct QueryBatch {
+  // For each set, the queries resized to its geometry, Stride() apart, and
+  // their squared norms, channel sums, colour moments, thumbnails, distances
+  // to the pivots and DCT coefficients. Nearby holds, in order, the
+  // fingerprints near enough in colour to each query, found once from the
+  // moment tree for every range to share (left empty for the matrix multiply
+  // and approximate searches, which don't use it).
+  std::vector<PixelArena> Samples;
+  std::vector<std::vector<uint64_t>> Norms;
+  std::vector<std::vector<ChannelSums>> Sums;
+  std::vector<std::vector<ColourMoments>> Moments;
+  std::vector<std::vector<std::vector<uint32_t>>> Nearby;
+  std::vector<std::vector<uint8_t>> Thumbnails;
+  std::vector<std::vector<float>> PivotDistances;
+  std::vector<std::vector<float>> Coefficients;
+
+  std::vector<std::string> Filenames;
+  std::vector<uint64_t> Sequences;
 };
 
 class FingerprintStore {
 public:
   FingerprintStore(std::string srcDirectory);
 
-  void Load();
+  // Load the fingerprints, and the indexes for any approximate search, using
+  // the given number of threads for the work done on loading.
+  void Load(const size_t threads, const ApproximateSearch &approximate = {});
 
   // Run a given task in multiple threads.
   void RunWorkers(const WorkerOptions options);
 
 private:
-  // Compare a single image to all of the fingerprints
-  void FindMatchesForImage(Magick::Image image, const std::string filename,
-                           const int fuzzFactor);
+  // Lay out a loaded set's arena from the samples collected for it, sorted by
+  // their sums, and work out everything else needed to search it. The pivot
+  // table is read from the store if it was saved there for the same
+  // fingerprints, or built and saved for next time. So are the indexes for an
+  // approximate search.
+  void IndexSet(FingerprintSet &set, const std::vector<uint8_t> &samples,
+                const ApproximateSearch &approximate);
 
-  // Find duplicates in a whole directory compared to the fingerprints.
-  void FindDuplicates(DirectoryWalker *dw, const int fuzzFactor);
+  // Link the fingerprints in a set to the nodes of the graph saved with the
+  // store, adding those it doesn't have yet.
+  void IndexGraph(FingerprintSet &set);
+
+  // Sort the fingerprints in a set into inverted lists, by the centroids
+  // saved with the store. If there are none yet they are trained from the
+  // set itself, and saved.
+  void IndexLists(FingerprintSet &set);
+
+  // Encode the fingerprints in a set with the product quantiser saved with
+  // the store, or trained from the set and saved if there is none yet.
+  void IndexCodes(FingerprintSet &set);
+
+  // Hash the fingerprints in a set into as many random projection tables as
+  // asked for. They take seconds to build, so aren't saved.
+  void IndexHashes(FingerprintSet &set, const size_t tables);
+
+  // Index the wavelet signatures of the fingerprints in a set. Like the
+  // coefficients, they are quick to work out from the fingerprints.
+  void IndexWavelets(FingerprintSet &set);
+
+  // Where a table or graph for a geometry is kept in a store, e.g.
+  // ".pivots-100x100" in the directory.
+  static boost::filesystem::path StorePath(const std::string &directory,
+                                           const std::string &kind,
+                                           const std::string &spec);
+
+  // The graph saved at a path, or an empty one if there isn't one there.
+  static std::unique_ptr<HnswIndex>
+  ReadGraph(const boost::filesystem::path &path, const size_t dimensions);
+
+  // Identifies the fingerprints in a set, their samples and their order, for
+  // saved tables. The samples are hashed on the given number of threads.
+  static uint64_t Checksum(const FingerprintSet &set, const size_t threads);
+
+  // Compare a batch of queries to the fingerprints from begin to end in a set
+  // at once, using the given copy of its arena, and write a line to each
+  // query's output for every match. Only fingerprints in each query's window
+  // that pass every PruningCheck are compared, and those too far off in colour
+  // are left out up front by the moment tree. Each block of them is compared
+  // with every query while it is in L2, so the arena is streamed from memory
+  // once per batch rather than once per query.
+  void FindMatchesForBatch(const QueryBatch &batch, const size_t setIndex,
+                           const PixelArena &arena, const size_t begin,
+                           const size_t end, const bool matrixMultiply,
+                           std::vector<std::stringstream> &outputs);
+
+  // The fingerprints from begin to end in a set whose total is close enough to
+  // a query's for them to possibly match.
+  std::pair<size_t, size_t> MatchWindow(const FingerprintSet &set,
+                                        const ChannelSums &query,
+                                        const size_t begin, const size_t end);
+
+  // False if one of the PruningChecks shows a query in a batch can't match a
+  // fingerprint in its window. Counts the checks passed in passed.
+  bool MayMatch(const QueryBatch &batch, const size_t setIndex,
+                const size_t query, const size_t fingerprint,
+                uint64_t passed[PruningChecks]);
+
+  static ChannelSums SumChannels(const uint8_t *samples, const size_t count);
+
+  // Find candidates for a query in a batch with a set's indexes, and write a
+  // line to output for each of them that really matches. Every so often the
+  // query is also compared with every fingerprint, to estimate how many
+  // matches the indexes miss.
+  void FindApproximateMatches(const QueryBatch &batch, const size_t setIndex,
+                              const size_t query, const PixelArena &arena,
+                              const ApproximateSearch &approximate,
+                              std::stringstream &output);
+
+  // Root mean squared error normalised to 0..1 the same way as ImageMagick's
+  // RootMeanSquaredErrorMetric.
+  static double Distortion(const uint64_t squaredDistance,
+                           const size_t samples);
+
+  // Write a line to output if a query and fingerprint with this squared
+  // distance between them match, and return whether they did.
+  bool WriteMatch(const std::string &filename, const std::string &name,
+                  const uint64_t squaredDistance, const size_t samples,
+                  std::stringstream &output);
+
+  // Find duplicates in a whole directory compared to the fingerprints, using
+  // the copies of them on the given NUMA node. Queries are compared in
+  // batches of batchSize, or searched for approximately if enabled.
+  void FindDuplicates(WorkerContext context, const size_t node,
+                      const size_t batchSize, const bool matrixMultiply,
+                      const ApproximateSearch &approximate);
+
+  // Compare every query in the batch, complete them on the sink and empty
+  // the batch. The comparisons are split into tasks over ranges of the
+  // fingerprints, or over queries when searching approximately, which other
+  // workers can help with.
+  void CompareBatch(WorkerContext context, QueryBatch &batch,
+                    const size_t node, const bool matrixMultiply,
+                    const ApproximateSearch &approximate);
 
   // Entrypoint for generating fingerprints in parallel threads
-  void Generate(DirectoryWalker *dw, const std::string dstDirectory);
+  void Generate(WorkerContext context, const std::string dstDirectory,
+                const std::string spec);
 
   // Worker for outputting metadata.
   // Currently the only metadata is the created date of the image.
-  void ExtractMetadata(DirectoryWalker *dw);
+  void ExtractMetadata(WorkerContext context);
+
+  // Make a copy of every fingerprint arena on each NUMA node, written by a
+  // thread pinned to that node so its pages are local.
+  void ReplicateAcrossNodes(const std::vector<std::vector<int>> &nodes);
+
+  // Export the pixels of an image already resized to a fingerprint geometry as
+  // packed 8-bit RGB samples.
+  void ExportSamples(Magick::Image &image, uint8_t *samples);
+
+  // Decode an image, from memory if the reader stage has already read the
+  // file, otherwise by letting ImageMagick read it. Throws if the watchdog
+  // (when given) abandons it.
+  void Decode(const ImageFile &file, Magick::Image &image,
+              DecodeWatchdog::Watch *watch);
+
+  // Resize an image to a fingerprint geometry, under the watchdog.
+  void Resize(Magick::Image &image, const std::string spec,
+              DecodeWatchdog::Watch *watch);
+
+  // Decode (or just ping) an image straight from the memory the reader stage
+  // holds it in, without the copy Magick::Blob would make.
+  static Magick::Image DecodeInPlace(const ImageFile &file, const bool ping,
+                                     DecodeWatchdog::Watch *watch);
+
+  // The filename to give ImageMagick, prefixed with the sniffed format (if
+  // any) so it goes straight to that decoder rather than guessing.
+  static std::string MagickFilename(const ImageFile &file);
+
+  // Reserve an estimate of the decoded pixel memory for a file, based on the
+  // dimensions in its header. Blocks while the memory budget is exhausted.
+  MemoryBudget::Reservation ReserveDecode(MemoryBudget *budget,
+                                          const ImageFile &file);
 
   // Converts a timestamp like "2011:07:09 20:01:28" into a standard format
   // (hyphens between date parts).
@@ -41,13 +322,38 @@ private:
   // Source directory for the given operation
   std::string SrcDirectory;
 
-  // Store all fingerprint images in memory for now
-  std::vector<std::pair<Magick::Image, std::string>> Fingerprints;
+  // Threads to index the fingerprints with as they are loaded.
+  size_t Threads = 1;
+
+  // Store all fingerprint samples in memory for now, one set per geometry.
+  std::vector<FingerprintSet> Sets;
 
   const double LowDistortionThreshold = 0.01;  // identical images
   const double HighDistortionThreshold = 0.02; // similar images
 
-  // Dimension specification for comparison fingerprints.
-  // ! means ignoring proportions
-  const std::string FingerprintSpec = "100x100!";
+  // The moment, pivot and DCT bounds are worked out in floats, whose rounding
+  // could put one just over the true distance. A pair is only ruled out by a
+  // bound over the limit by more than this fraction of it.
+  const double RoundingMargin = 1e-3;
+
+  // How many walk entries ahead of the oldest incomplete one a worker may be
+  // before its output has to wait, in ordered output mode.
+  const uint64_t OrderedOutputWindow = 4096;
+
+  // Files that looked like images but still failed to decode.
+  std::atomic<size_t> DecodeFailures{0};
+
+  // Query and fingerprint pairs that passed each check, and that were
+  // compared pixel by pixel, out of all those that could have been.
+  std::atomic<uint64_t> PairsPassed[PruningChecks]{};
+  std::atomic<uint64_t> PairsCompared{0};
+  std::atomic<uint64_t> PairsTotal{0};
+
+  // Approximate searches, and the matches found by the indexes out of those
+  // there were for the ones also checked against every fingerprint.
+  const uint64_t RecallInterval = 16;
+  std::atomic<uint64_t> ApproximateSearches{0};
+  std::atomic<uint64_t> RecallChecks{0};
+  std::atomic<uint64_t> RecallExpected{0};
+  std::atomic<uint64_t> RecallFound{0};
 };
\ No newline at end of file
@@ -0,0 +1,420 @@
+#include "CompactDct.hpp"
+#include "Util.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <queue>
+#include <random>
+
+#include "HnswIndex.hpp"
+
+namespace {
+// Identifies a saved graph, and its layout.
+const char Magic[8] = {'P', 'F', 'H', 'N', 'S', 'W', '0', '1'};
+
+template <typename T> void Put(std::ostream &out, const T &value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T> bool Get(std::istream &in, T &value) {
+  in.read(reinterpret_cast<char *>(&value), sizeof(value));
+  return bool(in);
+}
+
+// The layer a new node goes up to: each is Links times sparser than the one
+// below it.
+int RandomLayer() {
+  thread_local std::mt19937_64 random(std::random_device{}());
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  double u = 1.0 - uniform(random);
+  return int(-std::log(u) / std::log(double(HnswIndex::Links)));
+}
+} // namespace
+
+HnswIndex::HnswIndex(const size_t dimensions)
+    : DimensionCount(dimensions),
+      Chunks((size_t(UINT32_MAX) + 1) / ChunkSize) {}
+
+HnswIndex::Node &HnswIndex::At(const uint32_t node) const {
+  return Chunks[node >> ChunkBits][node & (ChunkSize - 1)];
+}
+
+uint32_t HnswIndex::Allocate() {
+  uint32_t node = Count++;
+  std::lock_guard<std::mutex> lock(ChunksLock);
+  auto &chunk = Chunks[node >> ChunkBits];
+  if (!chunk)
+    chunk.reset(new Node[ChunkSize]);
+  return node;
+}
+
+float HnswIndex::Distance(const float *a, const float *b) const {
+  return CompactDct::SquaredDistance(a, b, DimensionCount);
+}
+
+std::vector<uint32_t> HnswIndex::NeighboursOf(const uint32_t node,
+                                              const size_t layer) const {
+  const Node &n = At(node);
+  std::lock_guard<std::mutex> lock(n.Lock);
+  if (layer >= n.Neighbours.size())
+    return {};
+  return n.Neighbours[layer];
+}
+
+uint32_t HnswIndex::Insert(const float *vector, const std::string &name) {
+  {
+    std::lock_guard<std::mutex> lock(CurrentLock);
+    auto found = Current.find(name);
+    if (found != Current.end() &&
+        std::equal(vector, vector + DimensionCount,
+                   At(found->second).Vector.begin()))
+      return found->second;
+  }
+
+  // Nobody else can reach the node until it is linked in below.
+  uint32_t id = Allocate();
+  Node &node = At(id);
+  node.Vector.assign(vector, vector + DimensionCount);
+  node.Name = name;
+  {
+    std::lock_guard<std::mutex> lock(CurrentLock);
+    Current[name] = id;
+  }
+  int layer = RandomLayer();
+  node.Neighbours.resize(layer + 1);
+
+  uint32_t entry;
+  int top;
+  {
+    std::lock_guard<std::mutex> lock(EntryLock);
+    if (TopLayer < 0) {
+      Entry = id;
+      TopLayer = layer;
+      return id;
+    }
+    entry = Entry;
+    top = TopLayer;
+  }
+
+  std::vector<std::pair<float, uint32_t>> nearest = {
+      {Distance(vector, At(entry).Vector.data()), entry}};
+  for (int l = top; l > layer; l--)
+    nearest = SearchLayer(vector, nearest, 1, l);
+
+  for (int l = std::min(top, layer); l >= 0; l--) {
+    nearest = SearchLayer(vector, nearest, BuildBreadth, l);
+    auto neighbours = SelectNeighbours(nearest, Links);
+    {
+      std::lock_guard<std::mutex> lock(node.Lock);
+      node.Neighbours[l] = neighbours;
+    }
+    for (auto neighbour : neighbours)
+      Link(neighbour, id, l);
+  }
+
+  if (layer > top) {
+    std::lock_guard<std::mutex> lock(EntryLock);
+    if (layer > TopLayer) {
+      Entry = id;
+      TopLayer = layer;
+    }
+  }
+  return id;
+}
+
+std::vector<std::pair<float, uint32_t>>
+HnswIndex::Search(const float *query, const size_t breadth) const {
+  uint32_t entry;
+  int top;
+  {
+    std::lock_guard<std::mutex> lock(EntryLock);
+    if (TopLayer < 0)
+      return {};
+    entry = Entry;
+    top = TopLayer;
+  }
+
+  std::vector<std::pair<float, uint32_t>> nearest = {
+      {Distance(query, At(entry).Vector.data()), entry}};
+  for (int l = top; l > 0; l--)
+    nearest = SearchLayer(query, nearest, 1, l);
+  return SearchLayer(query, nearest, std::max<size_t>(breadth, 1), 0);
+}
+
+std::vector<std::pair<float, uint32_t>> HnswIndex::SearchLayer(
+    const float *query, const std::vector<std::pair<float, uint32_t>> &start,
+    const size_t breadth, const size_t layer) const {
+  using Candidate = std::pair<float, uint32_t>;
+  std::priority_queue<Candidate, std::vector<Candidate>, std::greater<>>
+      candidates;
+  std::priority_queue<Candidate> results;
+
+  // Nodes visited are marked with a number unique to this search, so the
+  // marks never need clearing.
+  thread_local std::vector<uint32_t> marks;
+  thread_local uint32_t search = 0;
+  if (++search == 0) {
+    std::fill(marks.begin(), marks.end(), 0);
+    search = 1;
+  }
+  auto visit = [&](const uint32_t node) {
+    if (node >= marks.size())
+      marks.resize(std::max<size_t>(node + 1, Count), 0);
+    if (marks[node] == search)
+      return false;
+    marks[node] = search;
+    return true;
+  };
+
+  for (auto &candidate : start) {
+    visit(candidate.second);
+    candidates.push(candidate);
+    results.push(candidate);
+    if (results.size() > breadth)
+      results.pop();
+  }
+
+  while (!candidates.empty()) {
+    Candidate nearest = candidates.top();
+    if (results.size() >= breadth && nearest.first > results.top().first)
+      break;
+    candidates.pop();
+
+    for (auto neighbour : NeighboursOf(nearest.second, layer)) {
+      if (!visit(neighbour))
+        continue;
+
+      float distance = Distance(query, At(neighbour).Vector.data());
+      if (results.size() < breadth || distance < results.top().first) {
+        candidates.push({distance, neighbour});
+        results.push({distance, neighbour});
+        if (results.size() > breadth)
+          results.pop();
+      }
+    }
+  }
+
+  std::vector<Candidate> found(results.size());
+  for (size_t j = found.size(); j > 0; j--) {
+    found[j - 1] = results.top();
+    results.pop();
+  }
+  return found;
+}
+
+std::vector<uint32_t> HnswIndex::SelectNeighbours(
+    const std::vector<std::pair<float, uint32_t>> &candidates,
+    const size_t limit) const {
+  std::vector<uint32_t> selected;
+  for (auto &candidate : candidates) {
+    if (selected.size() == limit)
+      break;
+
+    const float *vector = At(candidate.second).Vector.data();
+    bool closer = std::any_of(selected.begin(), selected.end(), [&](auto s) {
+      return Distance(vector, At(s).Vector.data()) < candidate.first;
+    });
+    if (!closer)
+      selected.push_back(candidate.second);
+  }
+  return selected;
+}
+
+void HnswIndex::Link(const uint32_t from, const uint32_t to,
+                     const size_t layer) {
+  Node &node = At(from);
+  std::lock_guard<std::mutex> lock(node.Lock);
+  auto &neighbours = node.Neighbours[layer];
+  neighbours.push_back(to);
+
+  const size_t limit = layer == 0 ? 2 * Links : Links;
+  if (neighbours.size() <= limit)
+    return;
+
+  std::vector<std::pair<float, uint32_t>> candidates;
+  for (auto neighbour : neighbours)
+    candidates.push_back(
+        {Distance(node.Vector.data(), At(neighbour).Vector.data()),
+         neighbour});
+  std::sort(candidates.begin(), candidates.end());
+  neighbours = SelectNeighbours(candidates, limit);
+}
+
+const std::string &HnswIndex::Name(const uint32_t node) const {
+  return At(node).Name;
+}
+
+const float *HnswIndex::Vector(const uint32_t node) const {
+  return At(node).Vector.data();
+}
+
+uint32_t HnswIndex::Find(const std::string &name) const {
+  std::lock_guard<std::mutex> lock(CurrentLock);
+  auto found = Current.find(name);
+  return found == Current.end() ? Missing : found->second;
+}
+
+void HnswIndex::Retain(const std::vector<bool> &keep, const size_t threads) {
+  // A node that loses links to dropped ones is relinked to the best of those
+  // it has left and the neighbours of those it lost, which it used to be
+  // reached through, as HNSW deletion usually goes. All of it is worked out
+  // before anything moves.
+  std::vector<std::vector<std::vector<uint32_t>>> repaired(Count);
+  Util::Parallel(Count, threads, [&](size_t first, size_t last) {
+    for (size_t j = first; j < last; j++) {
+      const Node &node = At(j);
+      for (size_t l = 0; keep[j] && l < node.Neighbours.size(); l++) {
+        const auto &neighbours = node.Neighbours[l];
+        if (std::all_of(neighbours.begin(), neighbours.end(),
+                        [&](uint32_t n) { return keep[n]; }))
+          continue;
+
+        std::vector<uint32_t> candidates;
+        for (auto neighbour : neighbours) {
+          const Node &lost = At(neighbour);
+          if (keep[neighbour])
+            candidates.push_back(neighbour);
+          else if (l < lost.Neighbours.size())
+            for (auto second : lost.Neighbours[l])
+              if (keep[second] && second != j)
+                candidates.push_back(second);
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                         candidates.end());
+
+        std::vector<std::pair<float, uint32_t>> nearest;
+        for (auto candidate : candidates)
+          nearest.push_back(
+              {Distance(node.Vector.data(), At(candidate).Vector.data()),
+               candidate});
+        std::sort(nearest.begin(), nearest.end());
+        if (repaired[j].empty())
+          repaired[j] = node.Neighbours;
+        repaired[j][l] = SelectNeighbours(nearest, l == 0 ? 2 * Links : Links);
+      }
+    }
+  });
+
+  std::vector<uint32_t> renumbered(Count, Missing);
+  uint32_t kept = 0;
+  for (uint32_t j = 0; j < Count; j++)
+    if (keep[j])
+      renumbered[j] = kept++;
+
+  // Nodes only move down, so each can be moved over one already dealt with.
+  uint32_t entry = Missing;
+  int top = -1;
+  Current.clear();
+  for (uint32_t j = 0; j < Count; j++) {
+    if (renumbered[j] == Missing)
+      continue;
+    Node &from = At(j), &to = At(renumbered[j]);
+    if (!repaired[j].empty())
+      from.Neighbours = std::move(repaired[j]);
+    if (&to != &from) {
+      to.Vector = std::move(from.Vector);
+      to.Name = std::move(from.Name);
+      to.Neighbours = std::move(from.Neighbours);
+    }
+    for (auto &neighbours : to.Neighbours) {
+      std::vector<uint32_t> remaining;
+      for (auto neighbour : neighbours)
+        if (renumbered[neighbour] != Missing)
+          remaining.push_back(renumbered[neighbour]);
+      neighbours = std::move(remaining);
+    }
+    Current[to.Name] = renumbered[j];
+
+    // The entry stays if it can, or else the highest node left takes over.
+    int layer = int(to.Neighbours.size()) - 1;
+    if (j == Entry || (renumbered[Entry] == Missing && layer > top)) {
+      entry = renumbered[j];
+      top = j == Entry ? TopLayer : layer;
+    }
+  }
+  for (uint32_t j = kept; j < Count; j++) {
+    Node &node = At(j);
+    node.Vector = {};
+    node.Name = {};
+    node.Neighbours = {};
+  }
+
+  Count = kept;
+  Entry = kept > 0 ? entry : 0;
+  TopLayer = kept > 0 ? top : -1;
+}
+
+bool HnswIndex::Read(const boost::filesystem::path &path) {
+  std::ifstream file(path.string(), std::ios::binary);
+  char magic[sizeof(Magic)];
+  uint64_t dimensions = 0, count = 0;
+  uint32_t entry = 0;
+  int32_t top = -1;
+  file.read(magic, sizeof(magic));
+  if (!file || !std::equal(magic, magic + sizeof(magic), Magic) ||
+      !Get(file, dimensions) || !Get(file, count) || !Get(file, entry) ||
+      !Get(file, top) || dimensions != DimensionCount || Count != 0 ||
+      count > UINT32_MAX || (count > 0 && entry >= count))
+    return false;
+
+  for (uint64_t j = 0; j < count; j++) {
+    Node &node = At(Allocate());
+    uint64_t nameLength = 0;
+    uint32_t layers = 0;
+    if (!Get(file, nameLength) || nameLength > 65536)
+      return false;
+    node.Name.resize(nameLength);
+    node.Vector.resize(DimensionCount);
+    file.read(&node.Name[0], nameLength);
+    file.read(reinterpret_cast<char *>(node.Vector.data()),
+              DimensionCount * sizeof(float));
+    if (!Get(file, layers) || layers == 0 || layers > 64)
+      return false;
+
+    node.Neighbours.resize(layers);
+    for (auto &neighbours : node.Neighbours) {
+      uint32_t size = 0;
+      if (!Get(file, size) || size > 2 * Links)
+        return false;
+      neighbours.resize(size);
+      file.read(reinterpret_cast<char *>(neighbours.data()),
+                size * sizeof(uint32_t));
+      for (auto neighbour : neighbours)
+        if (neighbour >= count)
+          return false;
+    }
+  }
+
+  if (!file)
+    return false;
+  for (uint32_t j = 0; j < count; j++)
+    Current[At(j).Name] = j;
+  Entry = entry;
+  TopLayer = count > 0 ? top : -1;
+  return true;
+}
+
+bool HnswIndex::Write(const boost::filesystem::path &path) const {
+  return Util::WriteAtomically(path, [&](std::ostream &file) {
+    file.write(Magic, sizeof(Magic));
+    Put(file, uint64_t(DimensionCount));
+    Put(file, uint64_t(Count));
+    Put(file, Entry);
+    Put(file, int32_t(TopLayer));
+
+    for (uint32_t j = 0; j < Count; j++) {
+      const Node &node = At(j);
+      Put(file, uint64_t(node.Name.size()));
+      file.write(node.Name.data(), node.Name.size());
+      file.write(reinterpret_cast<const char *>(node.Vector.data()),
+                 DimensionCount * sizeof(float));
+      Put(file, uint32_t(node.Neighbours.size()));
+      for (auto &neighbours : node.Neighbours) {
+        Put(file, uint32_t(neighbours.size()));
+        file.write(reinterpret_cast<const char *>(neighbours.data()),
+                   neighbours.size() * sizeof(uint32_t));
+      }
+    }
+  });
+}
\ No newline at end of file
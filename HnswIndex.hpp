@@ -0,0 +1,122 @@
+#include <atomic>
+#include <boost/filesystem.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Hierarchical navigable small world graph over compact fingerprint vectors
+// (their low frequency DCT coefficients), for approximate nearest neighbour
+// search in stores too big to scan. Each vector is linked to its near
+// neighbours, on layer 0 and on as many of the sparser layers above as it is
+// randomly promoted to; a search descends greedily from the top and then
+// explores the neighbourhood of the best few on layer 0.
+//
+// Insertion is safe from any number of threads at once, so the graph grows
+// as fingerprints are generated, and each vector carries the name of its
+// fingerprint so a store can find its own fingerprints in it. A name has one
+// current node, the last inserted under it.
+class HnswIndex {
+public:
+  // Neighbours kept per vector on each layer above 0, where twice as many are
+  // kept. More make for better recall at the cost of memory and time.
+  static const size_t Links = 16;
+
+  // Candidates considered when linking a new vector in.
+  static const size_t BuildBreadth = 200;
+
+  HnswIndex(const size_t dimensions);
+
+  size_t Dimensions() const { return DimensionCount; }
+  size_t Size() const { return Count; }
+
+  // Add a vector of Dimensions() floats, returning its node. The same vector
+  // under the same name isn't added again, but the existing node returned; a
+  // different one becomes the current node for the name, and the old one is
+  // left for Retain() to drop.
+  uint32_t Insert(const float *vector, const std::string &name);
+
+  // The current node for a name, or Missing if there isn't one.
+  static const uint32_t Missing = UINT32_MAX;
+  uint32_t Find(const std::string &name) const;
+
+  // Drop every node not kept, and all links to them, renumbering the rest in
+  // the same order. Nodes linked to dropped ones are relinked from the
+  // neighbours those had, on the given number of threads, so the graph stays
+  // navigable however often it's trimmed. Not safe while the graph is
+  // otherwise in use.
+  void Retain(const std::vector<bool> &keep, const size_t threads);
+
+  // The nodes nearest to a query, closest first with their squared distances,
+  // from a search keeping breadth candidates. The wider the search, the more
+  // likely it finds the true nearest, and the longer it takes.
+  std::vector<std::pair<float, uint32_t>> Search(const float *query,
+                                                 const size_t breadth) const;
+
+  const std::string &Name(const uint32_t node) const;
+  const float *Vector(const uint32_t node) const;
+
+  // Load a graph saved by Write() with vectors of the same dimensions. False
+  // if there is none, or it doesn't fit.
+  bool Read(const boost::filesystem::path &path);
+  bool Write(const boost::filesystem::path &path) const;
+
+private:
+  struct Node {
+    std::vector<float> Vector;
+    std::string Name;
+
+    // Neighbours on each layer the node is on, guarded by Lock.
+    std::vector<std::vector<uint32_t>> Neighbours;
+    mutable std::mutex Lock;
+  };
+
+  // Nodes live in chunks that are never moved, so readers need no lock to
+  // reach them while others are inserting.
+  static const size_t ChunkBits = 16;
+  static const size_t ChunkSize = size_t(1) << ChunkBits;
+
+  Node &At(const uint32_t node) const;
+  uint32_t Allocate();
+
+  float Distance(const float *a, const float *b) const;
+  std::vector<uint32_t> NeighboursOf(const uint32_t node,
+                                     const size_t layer) const;
+
+  // The breadth nearest nodes to a query found on one layer, starting from
+  // the given nodes, closest first.
+  std::vector<std::pair<float, uint32_t>>
+  SearchLayer(const float *query,
+              const std::vector<std::pair<float, uint32_t>> &start,
+              const size_t breadth, const size_t layer) const;
+
+  // Up to limit of the candidates to link to, preferring ones that aren't
+  // already closer to another chosen one, which keeps the graph navigable
+  // across clusters.
+  std::vector<uint32_t>
+  SelectNeighbours(const std::vector<std::pair<float, uint32_t>> &candidates,
+                   const size_t limit) const;
+
+  // Link from one node to another, pruning its neighbours if that makes too
+  // many.
+  void Link(const uint32_t from, const uint32_t to, const size_t layer);
+
+  size_t DimensionCount;
+  std::atomic<uint32_t> Count{0};
+
+  std::vector<std::unique_ptr<Node[]>> Chunks;
+  std::mutex ChunksLock;
+
+  // The current node for each name.
+  std::unordered_map<std::string, uint32_t> Current;
+  mutable std::mutex CurrentLock;
+
+  // Where every search starts: a node on the top layer.
+  uint32_t Entry = 0;
+  int TopLayer = -1;
+  mutable std::mutex EntryLock;
+};
\ No newline at end of file
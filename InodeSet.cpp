@@ -0,0 +1,53 @@
+#include "InodeSet.hpp"
+#include <algorithm>
+
+bool InodeSet::Insert(const uint64_t device, const uint64_t inode,
+                      const uint32_t value, uint32_t *existing) {
+  uint64_t hash = Hash(device, inode);
+  Shard &shard = Shards[hash % ShardCount];
+  std::lock_guard<std::mutex> lock(shard.Mutex);
+
+  if ((shard.Used + 1) * 2 > shard.Slots.size())
+    Grow(shard);
+
+  // The low bits picked the shard, so probe with the rest.
+  size_t mask = shard.Slots.size() - 1;
+  for (size_t i = (hash / ShardCount) & mask;; i = (i + 1) & mask) {
+    Slot &slot = shard.Slots[i];
+    if (slot.Inode == 0) {
+      slot = {device, inode, value};
+      shard.Used++;
+      return true;
+    }
+
+    if (slot.Device == device && slot.Inode == inode) {
+      if (existing)
+        *existing = slot.Value;
+      return false;
+    }
+  }
+}
+
+uint64_t InodeSet::Hash(const uint64_t device, const uint64_t inode) {
+  // Inode numbers are often sequential, so mix them thoroughly (splitmix64).
+  uint64_t h = inode ^ (device * 0x9E3779B97F4A7C15ULL);
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  return h ^ (h >> 31);
+}
+
+void InodeSet::Grow(Shard &shard) {
+  std::vector<Slot> old(std::max<size_t>(shard.Slots.size() * 2, 64));
+  old.swap(shard.Slots);
+
+  size_t mask = shard.Slots.size() - 1;
+  for (const Slot &slot : old) {
+    if (slot.Inode == 0)
+      continue;
+
+    size_t i = (Hash(slot.Device, slot.Inode) / ShardCount) & mask;
+    while (shard.Slots[i].Inode != 0)
+      i = (i + 1) & mask;
+    shard.Slots[i] = slot;
+  }
+}
\ No newline at end of file
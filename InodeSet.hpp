@@ -0,0 +1,42 @@
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Set of files identified by (device, inode), for noticing when the same
+// physical file or directory is reached by more than one path. Entries are
+// kept in flat open-addressed tables split into independently locked shards,
+// so millions of files take a few tens of megabytes and any number of threads
+// can insert at once.
+class InodeSet {
+public:
+  // Value for entries that don't carry one.
+  static const uint32_t NoValue = UINT32_MAX;
+
+  // Adds the file with the given value and returns true if it wasn't already
+  // in the set. Otherwise returns false, and the value it was first added with
+  // is stored in existing (if given).
+  bool Insert(const uint64_t device, const uint64_t inode,
+              const uint32_t value = NoValue, uint32_t *existing = nullptr);
+
+private:
+  struct Slot {
+    uint64_t Device = 0;
+    uint64_t Inode = 0; // 0 is never a valid inode, so marks an empty slot
+    uint32_t Value = NoValue;
+  };
+
+  struct Shard {
+    std::mutex Mutex;
+    std::vector<Slot> Slots;
+    size_t Used = 0;
+  };
+
+  static uint64_t Hash(const uint64_t device, const uint64_t inode);
+
+  // Double the table once it is half full, to keep probe sequences short.
+  static void Grow(Shard &shard);
+
+  static const size_t ShardCount = 16;
+  std::array<Shard, ShardCount> Shards;
+};
\ No newline at end of file
@@ -0,0 +1,203 @@
+#include "CompactDct.hpp"
+#include "Util.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+
+#include "InvertedFile.hpp"
+
+namespace {
+// Identifies saved centroids, and their layout.
+const char Magic[8] = {'P', 'F', 'I', 'V', 'F', '0', '0', '2'};
+
+// Lloyd's algorithm stops here even if some vectors are still moving between
+// lists, as by then hardly any are.
+const size_t MaxIterations = 16;
+
+const size_t MaxLists = 4096;
+
+// The nearest of count centroids to a vector.
+size_t NearestCentroid(const float *vector, const float *centroids,
+                       const size_t count, const size_t dimensions) {
+  size_t nearest = 0;
+  float best = INFINITY;
+  for (size_t j = 0; j < count; j++) {
+    float distance = CompactDct::SquaredDistance(
+        vector, centroids + j * dimensions, dimensions);
+    if (distance < best) {
+      best = distance;
+      nearest = j;
+    }
+  }
+  return nearest;
+}
+} // namespace
+
+InvertedFile::InvertedFile(const size_t dimensions)
+    : DimensionCount(dimensions), Random(std::random_device{}()) {}
+
+size_t InvertedFile::Nearest(const float *vector) const {
+  return NearestCentroid(vector, Centroids.data(), Lists(), DimensionCount);
+}
+
+void InvertedFile::Sample(const float *vector) {
+  std::lock_guard<std::mutex> lock(SampleLock);
+  size_t slot = Offered++;
+  if (slot >= SampleSize) {
+    slot = std::uniform_int_distribution<uint64_t>(0, slot)(Random);
+    if (slot >= SampleSize)
+      return;
+  }
+
+  if (Samples.size() < (slot + 1) * DimensionCount)
+    Samples.resize((slot + 1) * DimensionCount);
+  std::copy(vector, vector + DimensionCount,
+            Samples.begin() + slot * DimensionCount);
+}
+
+void InvertedFile::Train(const size_t threads) {
+  // Sized for everything offered, not just the sample.
+  size_t count = Samples.size() / DimensionCount;
+  size_t lists = std::sqrt(double(Offered));
+  lists = std::min({std::max<size_t>(lists, 1), count, MaxLists});
+  if (count == 0)
+    return;
+
+  Centroids = Cluster(Samples.data(), count, DimensionCount, DimensionCount,
+                      lists, Random, threads);
+  Trained = Offered;
+  Samples.clear();
+  Samples.shrink_to_fit();
+}
+
+void InvertedFile::Train(const float *vectors, const size_t count,
+                         const size_t threads) {
+  for (size_t j = 0; j < count; j++)
+    Sample(vectors + j * DimensionCount);
+  Train(threads);
+}
+
+std::vector<float> InvertedFile::Cluster(const float *vectors,
+                                         const size_t count,
+                                         const size_t stride,
+                                         const size_t dimensions,
+                                         const size_t clusters,
+                                         std::mt19937_64 &random,
+                                         const size_t threads) {
+  // Starting from distinct random vectors.
+  std::vector<size_t> order(count);
+  for (size_t j = 0; j < count; j++)
+    order[j] = j;
+  std::shuffle(order.begin(), order.end(), random);
+  std::vector<float> centroids(clusters * dimensions);
+  for (size_t c = 0; c < clusters; c++)
+    std::copy(vectors + order[c] * stride,
+              vectors + order[c] * stride + dimensions,
+              centroids.begin() + c * dimensions);
+
+  std::vector<size_t> assigned(count, clusters);
+  for (size_t iteration = 0; iteration < MaxIterations; iteration++) {
+    std::atomic<size_t> moved(0);
+    Util::Parallel(count, threads, [&](size_t first, size_t last) {
+      for (size_t j = first; j < last; j++) {
+        size_t nearest = NearestCentroid(vectors + j * stride, centroids.data(),
+                                         clusters, dimensions);
+        if (nearest != assigned[j]) {
+          assigned[j] = nearest;
+          moved++;
+        }
+      }
+    });
+    if (moved == 0)
+      break;
+
+    // Each centroid moves to the mean of its vectors. One left with none is
+    // restarted from a random vector instead.
+    std::vector<double> sums(clusters * dimensions);
+    std::vector<size_t> sizes(clusters);
+    for (size_t j = 0; j < count; j++) {
+      sizes[assigned[j]]++;
+      for (size_t d = 0; d < dimensions; d++)
+        sums[assigned[j] * dimensions + d] += vectors[j * stride + d];
+    }
+    for (size_t c = 0; c < clusters; c++) {
+      size_t from = std::uniform_int_distribution<size_t>(0, count - 1)(random);
+      for (size_t d = 0; d < dimensions; d++)
+        centroids[c * dimensions + d] =
+            sizes[c] > 0 ? float(sums[c * dimensions + d] / sizes[c])
+                         : vectors[from * stride + d];
+    }
+  }
+  return centroids;
+}
+
+void InvertedFile::Assign(const float *vectors, const size_t count,
+                          const size_t threads) {
+  std::vector<uint32_t> nearest(count);
+  Util::Parallel(count, threads, [&](size_t first, size_t last) {
+    for (size_t j = first; j < last; j++)
+      nearest[j] = Nearest(vectors + j * DimensionCount);
+  });
+
+  Util::Bucket(
+      count, Lists(), [&](size_t j) { return nearest[j]; }, Offsets, Entries);
+}
+
+std::vector<size_t> InvertedFile::NearestLists(const float *query,
+                                               const size_t probes) const {
+  std::vector<std::pair<float, size_t>> distances(Lists());
+  for (size_t list = 0; list < Lists(); list++)
+    distances[list] = {CompactDct::SquaredDistance(
+                           query, Centroids.data() + list * DimensionCount,
+                           DimensionCount),
+                       list};
+
+  size_t count = std::min(probes, distances.size());
+  std::partial_sort(distances.begin(), distances.begin() + count,
+                    distances.end());
+  std::vector<size_t> nearest;
+  for (size_t j = 0; j < count; j++)
+    nearest.push_back(distances[j].second);
+  return nearest;
+}
+
+std::pair<const uint32_t *, const uint32_t *>
+InvertedFile::List(const size_t list) const {
+  return {Entries.data() + Offsets[list], Entries.data() + Offsets[list + 1]};
+}
+
+bool InvertedFile::Read(const boost::filesystem::path &path) {
+  std::ifstream file(path.string(), std::ios::binary);
+  char magic[sizeof(Magic)];
+  uint64_t dimensions = 0, lists = 0, trained = 0;
+  file.read(magic, sizeof(magic));
+  file.read(reinterpret_cast<char *>(&dimensions), sizeof(dimensions));
+  file.read(reinterpret_cast<char *>(&lists), sizeof(lists));
+  file.read(reinterpret_cast<char *>(&trained), sizeof(trained));
+  if (!file || !std::equal(magic, magic + sizeof(magic), Magic) ||
+      dimensions != DimensionCount || lists == 0 || lists > MaxLists)
+    return false;
+
+  std::vector<float> centroids(lists * DimensionCount);
+  file.read(reinterpret_cast<char *>(centroids.data()),
+            centroids.size() * sizeof(float));
+  if (!file)
+    return false;
+
+  Centroids = std::move(centroids);
+  Trained = trained;
+  return true;
+}
+
+bool InvertedFile::Write(const boost::filesystem::path &path) const {
+  return Util::WriteAtomically(path, [&](std::ostream &file) {
+    uint64_t dimensions = DimensionCount, lists = Lists();
+    file.write(Magic, sizeof(Magic));
+    file.write(reinterpret_cast<const char *>(&dimensions), sizeof(dimensions));
+    file.write(reinterpret_cast<const char *>(&lists), sizeof(lists));
+    file.write(reinterpret_cast<const char *>(&Trained), sizeof(Trained));
+    file.write(reinterpret_cast<const char *>(Centroids.data()),
+               Centroids.size() * sizeof(float));
+  });
+}
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include <boost/filesystem.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <utility>
+#include <vector>
+
+// Inverted file over compact fingerprint vectors: a k-means coarse quantiser
+// splits the store into lists of the fingerprints nearest to each centroid,
+// and a query only scans the lists of the few centroids nearest to it. Near
+// duplicates almost always land in the same or a neighbouring list.
+//
+// The centroids are trained once, from a sample, and saved with the store.
+// The lists themselves are rebuilt whenever the store is loaded, one after
+// another in a single array so each is read as a sequential stream.
+class InvertedFile {
+public:
+  // Vectors kept in the training sample.
+  static const size_t SampleSize = 32768;
+
+  // How many times more vectors than the centroids were trained for a store
+  // can grow to before they should be trained again. The lists get longer as
+  // it grows, so each probe scans more of it.
+  static const size_t Growth = 4;
+
+  InvertedFile(const size_t dimensions);
+
+  size_t Dimensions() const { return DimensionCount; }
+  size_t Lists() const { return Centroids.size() / DimensionCount; }
+
+  // True if the centroids were trained for far fewer than count vectors.
+  bool Outgrown(const size_t count) const { return count > Growth * Trained; }
+
+  // Offer a vector for the training sample, of which a uniform sample is
+  // kept however many are offered (reservoir sampling). Safe to call from
+  // several threads at once.
+  void Sample(const float *vector);
+
+  // Train about one centroid for every square root of the vectors offered
+  // (or given), by Lloyd's algorithm from random starting points, on the
+  // given number of threads.
+  void Train(const size_t threads);
+  void Train(const float *vectors, const size_t count, const size_t threads);
+
+  // Cluster count vectors, stride floats apart, into the given number of
+  // centroids of their first dimensions, by Lloyd's algorithm from random
+  // starting points. The product quantiser uses this for its subspaces.
+  static std::vector<float> Cluster(const float *vectors, const size_t count,
+                                    const size_t stride,
+                                    const size_t dimensions,
+                                    const size_t clusters,
+                                    std::mt19937_64 &random,
+                                    const size_t threads);
+
+  // Put each of count vectors in the list of its nearest centroid.
+  void Assign(const float *vectors, const size_t count, const size_t threads);
+
+  // The probes lists nearest to a query, nearest first.
+  std::vector<size_t> NearestLists(const float *query,
+                                   const size_t probes) const;
+
+  // The vectors (by their index in Assign()) in a list, in order.
+  std::pair<const uint32_t *, const uint32_t *> List(const size_t list) const;
+
+  // Load centroids saved by Write() for vectors of the same dimensions, and
+  // how many vectors they were trained for.
+  bool Read(const boost::filesystem::path &path);
+  bool Write(const boost::filesystem::path &path) const;
+
+private:
+  size_t Nearest(const float *vector) const;
+
+  size_t DimensionCount;
+  std::vector<float> Centroids;
+
+  // The lists, as bucketed by Util::Bucket().
+  std::vector<uint32_t> Offsets;
+  std::vector<uint32_t> Entries;
+
+  // Training sample, how many vectors have been offered for it, and how many
+  // had been when the centroids were trained.
+  std::vector<float> Samples;
+  uint64_t Offered = 0;
+  uint64_t Trained = 0;
+  std::mt19937_64 Random;
+  std::mutex SampleLock;
+};
\ No newline at end of file
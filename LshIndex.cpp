@@ -0,0 +1,95 @@
+#include "Util.hpp"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "LshIndex.hpp"
+
+namespace {
+// The same hyperplanes every time, so results don't vary between runs.
+const uint64_t Seed = 0x5eed;
+} // namespace
+
+LshIndex::LshIndex(const size_t dimensions, const size_t tables)
+    : DimensionCount(dimensions), TableCount(tables),
+      Projections(tables * Bits * dimensions), Mean(dimensions),
+      Offsets(tables), Entries(tables) {
+  std::mt19937_64 random(Seed);
+  std::normal_distribution<float> normal;
+  for (auto &projection : Projections)
+    projection = normal(random);
+}
+
+uint32_t LshIndex::Hash(const size_t table, const float *vector,
+                        float *margins) const {
+  uint32_t hash = 0;
+  const float *normals = Projections.data() + table * Bits * DimensionCount;
+  for (size_t bit = 0; bit < Bits; bit++) {
+    const float *normal = normals + bit * DimensionCount;
+    float dot = 0;
+    for (size_t d = 0; d < DimensionCount; d++)
+      dot += normal[d] * (vector[d] - Mean[d]);
+    hash |= uint32_t(dot >= 0) << bit;
+    if (margins)
+      margins[bit] = std::fabs(dot);
+  }
+  return hash;
+}
+
+void LshIndex::Build(const float *vectors, const size_t count,
+                     const size_t threads) {
+  // Centred on the mean, as every coefficient vector is far out along the
+  // (always positive) DC terms and would otherwise hash alike.
+  std::fill(Mean.begin(), Mean.end(), 0.0f);
+  std::vector<double> sums(DimensionCount);
+  for (size_t j = 0; j < count; j++)
+    for (size_t d = 0; d < DimensionCount; d++)
+      sums[d] += vectors[j * DimensionCount + d];
+  for (size_t d = 0; d < DimensionCount && count > 0; d++)
+    Mean[d] = float(sums[d] / count);
+
+  std::vector<uint32_t> hashes(count * TableCount);
+  Util::Parallel(count, threads, [&](size_t first, size_t last) {
+    for (size_t j = first; j < last; j++)
+      for (size_t table = 0; table < TableCount; table++)
+        hashes[j * TableCount + table] =
+            Hash(table, vectors + j * DimensionCount);
+  });
+
+  Util::Parallel(TableCount, threads, [&](size_t first, size_t last) {
+    for (size_t table = first; table < last; table++)
+      Util::Bucket(
+          count, size_t(1) << Bits,
+          [&](size_t j) { return hashes[j * TableCount + table]; },
+          Offsets[table], Entries[table]);
+  });
+}
+
+std::vector<uint32_t> LshIndex::Candidates(const float *query) const {
+  std::vector<uint32_t> candidates;
+  float margins[Bits];
+  size_t bits[Bits];
+  for (size_t table = 0; table < TableCount; table++) {
+    uint32_t hash = Hash(table, query, margins);
+
+    // The query's own bucket, then each one across a nearest hyperplane.
+    for (size_t bit = 0; bit < Bits; bit++)
+      bits[bit] = bit;
+    size_t probes = std::min(ExtraProbes, Bits);
+    std::partial_sort(
+        bits, bits + probes, bits + Bits,
+        [&](size_t a, size_t b) { return margins[a] < margins[b]; });
+    for (size_t probe = 0; probe <= probes; probe++) {
+      uint32_t bucket = probe == 0 ? hash : hash ^ (1u << bits[probe - 1]);
+      const auto &offsets = Offsets[table];
+      candidates.insert(candidates.end(),
+                        Entries[table].begin() + offsets[bucket],
+                        Entries[table].begin() + offsets[bucket + 1]);
+    }
+  }
+
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                   candidates.end());
+  return candidates;
+}
\ No newline at end of file
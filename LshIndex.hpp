@@ -0,0 +1,48 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Locality sensitive hashing of compact fingerprint vectors by the signs of
+// random projections: each table hashes a vector to the side it falls of
+// each of Bits random hyperplanes (through the store's mean), so nearby
+// vectors mostly share buckets. A query looks in its own bucket in every
+// table, and also those across the hyperplanes it is closest to
+// (multi-probe), which catches most near neighbours from a few tables.
+//
+// The projections come from a fixed seed and nothing is saved: the tables
+// are rebuilt from scratch on every load, in parallel.
+class LshIndex {
+public:
+  // Hyperplanes per table, so buckets per table are 2^Bits.
+  static const size_t Bits = 16;
+
+  // Extra buckets probed in each table, one per nearest hyperplane.
+  static const size_t ExtraProbes = 8;
+
+  LshIndex(const size_t dimensions, const size_t tables);
+
+  size_t Tables() const { return TableCount; }
+
+  // Hash count vectors into every table, on the given number of threads.
+  void Build(const float *vectors, const size_t count, const size_t threads);
+
+  // Every vector (by its index in Build()) in the buckets probed for a
+  // query, sorted, and only once each.
+  std::vector<uint32_t> Candidates(const float *query) const;
+
+private:
+  // A vector's bucket in a table, and how far it is from each hyperplane.
+  uint32_t Hash(const size_t table, const float *vector,
+                float *margins = nullptr) const;
+
+  size_t DimensionCount;
+  size_t TableCount;
+
+  // Bits hyperplane normals per table, and the point they all go through.
+  std::vector<float> Projections;
+  std::vector<float> Mean;
+
+  // Each table's buckets, as bucketed by Util::Bucket().
+  std::vector<std::vector<uint32_t>> Offsets;
+  std::vector<std::vector<uint32_t>> Entries;
+};
\ No newline at end of file
@@ -0,0 +1,61 @@
+#include "MemoryBudget.hpp"
+#include "Magick++.h"
+#include <algorithm>
+
+MemoryBudget::MemoryBudget(const size_t limitBytes) : Limit(limitBytes) {}
+
+MemoryBudget::Reservation::Reservation(MemoryBudget *budget, const size_t bytes)
+    : Budget(budget), Bytes(bytes) {}
+
+MemoryBudget::Reservation::Reservation(Reservation &&other)
+    : Budget(other.Budget), Bytes(other.Bytes) {
+  other.Budget = nullptr;
+  other.Bytes = 0;
+}
+
+MemoryBudget::Reservation &
+MemoryBudget::Reservation::operator=(Reservation &&other) {
+  if (this != &other) {
+    Release();
+    std::swap(Budget, other.Budget);
+    std::swap(Bytes, other.Bytes);
+  }
+  return *this;
+}
+
+MemoryBudget::Reservation::~Reservation() { Release(); }
+
+void MemoryBudget::Reservation::Release() {
+  if (Budget != nullptr)
+    Budget->Release(Bytes);
+  Budget = nullptr;
+  Bytes = 0;
+}
+
+MemoryBudget::Reservation MemoryBudget::Reserve(const size_t bytes) {
+  if (!Enabled() || bytes == 0)
+    return Reservation();
+
+  std::unique_lock<std::mutex> lock(Mutex);
+  Available.wait(lock,
+                 [&] { return InUse == 0 || InUse + bytes <= Limit; });
+  InUse += bytes;
+  return Reservation(this, bytes);
+}
+
+void MemoryBudget::Release(const size_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    InUse -= bytes;
+  }
+  Available.notify_all();
+}
+
+size_t MemoryBudget::EstimateDecodeBytes(const size_t columns,
+                                         const size_t rows) {
+  // The pixel cache holds up to four channels (RGBA/CMYK) per pixel, and
+  // resize() allocates an intermediate image of about the same size again.
+  const size_t channels = 4;
+  const size_t copies = 2;
+  return columns * rows * channels * sizeof(Magick::Quantum) * copies;
+}
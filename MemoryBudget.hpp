@@ -0,0 +1,48 @@
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Global budget for decoded pixel memory, shared by all worker threads.
+// Each decode reserves an estimate of its pixel memory before it starts and
+// blocks while the budget is exhausted.
+class MemoryBudget {
+public:
+  // A limit of 0 disables admission control entirely.
+  MemoryBudget(const size_t limitBytes);
+
+  // Holds bytes against the budget until destroyed (or released early).
+  class Reservation {
+  public:
+    Reservation() = default;
+    Reservation(MemoryBudget *budget, const size_t bytes);
+    Reservation(Reservation &&other);
+    Reservation &operator=(Reservation &&other);
+    ~Reservation();
+
+    // Give the bytes back, e.g. as soon as the image has been shrunk.
+    void Release();
+
+  private:
+    MemoryBudget *Budget = nullptr;
+    size_t Bytes = 0;
+  };
+
+  // Blocks until the bytes fit in the budget. A request larger than the whole
+  // budget is admitted once nothing else is in flight, so a single huge image
+  // is still processed rather than deadlocking.
+  Reservation Reserve(const size_t bytes);
+
+  bool Enabled() const { return Limit != 0; }
+
+  // Estimate of the pixel memory needed to decode and resize an image with the
+  // given header dimensions.
+  static size_t EstimateDecodeBytes(const size_t columns, const size_t rows);
+
+private:
+  void Release(const size_t bytes);
+
+  size_t Limit;
+  size_t InUse = 0;
+  std::mutex Mutex;
+  std::condition_variable Available;
+};
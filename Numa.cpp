@@ -0,0 +1,78 @@
+#include "Numa.hpp"
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+std::vector<std::vector<int>> Numa::Nodes() {
+  std::vector<std::vector<int>> nodes;
+
+#ifdef __linux__
+  // Node numbers can have gaps where nodes have been taken offline, so the
+  // online ones are listed, in the same format as a node's CPUs.
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string onlineList;
+  std::getline(online, onlineList);
+
+  for (int node : ParseCpuList(onlineList)) {
+    std::stringstream path;
+    path << "/sys/devices/system/node/node" << node << "/cpulist";
+    std::ifstream file(path.str());
+    if (!file)
+      continue;
+
+    std::string list;
+    std::getline(file, list);
+    auto cpus = ParseCpuList(list);
+
+    // Memory-only nodes have no CPUs to run workers on.
+    if (!cpus.empty())
+      nodes.push_back(cpus);
+  }
+#endif
+
+  if (nodes.empty()) {
+    std::vector<int> all;
+    for (unsigned int i = 0; i < std::thread::hardware_concurrency(); i++)
+      all.push_back(i);
+    nodes.push_back(all);
+  }
+
+  return nodes;
+}
+
+bool Numa::PinCurrentThread(const std::vector<int> &cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+std::vector<int> Numa::ParseCpuList(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+
+  while (std::getline(ss, range, ',')) {
+    if (range.empty())
+      continue;
+
+    auto dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first
+                                         : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+  }
+
+  return cpus;
+}
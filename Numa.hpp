@@ -0,0 +1,20 @@
+#include <string>
+#include <vector>
+
+// NUMA topology discovery and thread pinning. Only implemented on Linux (via
+// sysfs and the pthread affinity API); elsewhere the machine is reported as a
+// single node and pinning does nothing.
+class Numa {
+public:
+  // The CPUs belonging to each NUMA node, indexed by node number.
+  // Always returns at least one node.
+  static std::vector<std::vector<int>> Nodes();
+
+  // Restrict the calling thread to the given CPUs, so that memory it touches
+  // first is allocated on their node. Returns false if pinning failed.
+  static bool PinCurrentThread(const std::vector<int> &cpus);
+
+private:
+  // Parse a sysfs CPU (or node) list such as "0-15,32-47".
+  static std::vector<int> ParseCpuList(const std::string &list);
+};
@@ -0,0 +1,40 @@
+#include "OutputSink.hpp"
+#include <iostream>
+
+OutputSink::OutputSink(const bool ordered, const uint64_t window)
+    : Ordered(ordered), Window(window) {}
+
+void OutputSink::Complete(const uint64_t sequence, const std::string &text) {
+  if (!Ordered) {
+    if (!text.empty())
+      std::cout << text << std::flush;
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(Mutex);
+
+  // Only output far ahead of the oldest incomplete entry waits, which bounds
+  // how much is buffered. Entries are handed to workers in order, so the
+  // oldest is always being worked on, or is in a batch whose worker is waiting
+  // on the reader for more; either way it never waits here itself. Workers
+  // must not hold reader buffers while waiting here, or the reader could be
+  // left with none to fill that batch. Empty completions (most of them) never
+  // wait, so skipping entries can't stall.
+  if (!text.empty())
+    Advanced.wait(lock, [&] { return sequence < Next + Window; });
+
+  if (sequence != Next) {
+    Pending.emplace(sequence, text);
+    return;
+  }
+
+  std::string output = text;
+  Next++;
+  for (auto it = Pending.begin(); it != Pending.end() && it->first == Next;
+       it = Pending.erase(it), Next++)
+    output += it->second;
+
+  if (!output.empty())
+    std::cout << output << std::flush;
+  Advanced.notify_all();
+}
@@ -0,0 +1,33 @@
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Destination for the results of every walk entry. Unordered, output is written
+// as soon as a worker completes an entry. Ordered, each entry's output is held
+// in a bounded reorder window until everything before it in walk order has
+// been written, so repeated runs produce identical output.
+class OutputSink {
+public:
+  // window is how far (in walk entries) a worker with output to write may run
+  // ahead of the oldest incomplete entry before it has to wait.
+  OutputSink(const bool ordered, const uint64_t window);
+
+  // Write the complete output (possibly empty) for one walk entry. Every
+  // sequence number handed out by the walker must be completed exactly once,
+  // including entries that are skipped.
+  void Complete(const uint64_t sequence, const std::string &text);
+
+  // Shorthand for an entry that produces no output.
+  void Skip(const uint64_t sequence) { Complete(sequence, ""); }
+
+private:
+  bool Ordered;
+  uint64_t Window;
+
+  std::mutex Mutex;
+  std::condition_variable Advanced;
+  uint64_t Next = 0;
+  std::map<uint64_t, std::string> Pending;
+};
@@ -0,0 +1,120 @@
+#include "DistanceKernel.hpp"
+#include "Util.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+#include "PivotTable.hpp"
+
+namespace {
+// Identifies a saved table, and its layout.
+const char Magic[8] = {'P', 'F', 'P', 'I', 'V', 'O', 'T', '1'};
+} // namespace
+
+void PivotTable::Build(const DistanceKernel &kernel,
+                       const uint8_t *fingerprints, const size_t count,
+                       const size_t threads) {
+  const size_t stride = kernel.Stride();
+  PivotIndices.clear();
+  Distances.clear();
+  if (count == 0)
+    return;
+
+  // Columns of distances to each pivot as it's chosen, and each fingerprint's
+  // distance to its nearest pivot so far.
+  std::vector<std::vector<float>> columns;
+  std::vector<float> nearest(count, INFINITY);
+
+  size_t pivot = 0;
+  while (PivotIndices.size() < MaxPivots) {
+    PivotIndices.push_back(pivot);
+    columns.emplace_back(count);
+    std::vector<float> &column = columns.back();
+
+    const uint8_t *from = fingerprints + pivot * stride;
+    Util::Parallel(count, threads, [&](size_t first, size_t last) {
+      for (size_t j = first; j < last; j++) {
+        column[j] = std::sqrt(
+            float(kernel.SquaredDistance(from, fingerprints + j * stride)));
+        nearest[j] = std::min(nearest[j], column[j]);
+      }
+    });
+
+    // Another pivot identical to one already chosen would add nothing.
+    auto farthest = std::max_element(nearest.begin(), nearest.end());
+    if (*farthest == 0)
+      break;
+    pivot = farthest - nearest.begin();
+  }
+
+  const size_t pivots = PivotIndices.size();
+  Distances.resize(count * pivots);
+  for (size_t p = 0; p < pivots; p++)
+    for (size_t j = 0; j < count; j++)
+      Distances[j * pivots + p] = columns[p][j];
+}
+
+bool PivotTable::Read(const boost::filesystem::path &path,
+                      const uint64_t checksum, const size_t count) {
+  std::ifstream file(path.string(), std::ios::binary);
+  if (!file)
+    return false;
+
+  char magic[sizeof(Magic)];
+  uint64_t savedChecksum = 0, savedCount = 0, pivots = 0;
+  file.read(magic, sizeof(magic));
+  file.read(reinterpret_cast<char *>(&savedChecksum), sizeof(savedChecksum));
+  file.read(reinterpret_cast<char *>(&savedCount), sizeof(savedCount));
+  file.read(reinterpret_cast<char *>(&pivots), sizeof(pivots));
+  if (!file || !std::equal(magic, magic + sizeof(magic), Magic) ||
+      savedChecksum != checksum || savedCount != count || pivots == 0 ||
+      pivots > MaxPivots)
+    return false;
+
+  std::vector<uint64_t> indices(pivots);
+  std::vector<float> distances(count * pivots);
+  file.read(reinterpret_cast<char *>(indices.data()),
+            indices.size() * sizeof(uint64_t));
+  file.read(reinterpret_cast<char *>(distances.data()),
+            distances.size() * sizeof(float));
+  if (!file)
+    return false;
+  for (auto index : indices)
+    if (index >= count)
+      return false;
+
+  PivotIndices.assign(indices.begin(), indices.end());
+  Distances = std::move(distances);
+  return true;
+}
+
+void PivotTable::Write(const boost::filesystem::path &path,
+                       const uint64_t checksum) const {
+  uint64_t pivots = PivotIndices.size();
+  uint64_t count = pivots == 0 ? 0 : Distances.size() / pivots;
+  std::vector<uint64_t> indices(PivotIndices.begin(), PivotIndices.end());
+  bool written = Util::WriteAtomically(path, [&](std::ostream &file) {
+    file.write(Magic, sizeof(Magic));
+    file.write(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+    file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    file.write(reinterpret_cast<const char *>(&pivots), sizeof(pivots));
+    file.write(reinterpret_cast<const char *>(indices.data()),
+               indices.size() * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char *>(Distances.data()),
+               Distances.size() * sizeof(float));
+  });
+  if (!written)
+    std::cerr << "Could not save pivot table to " << path.string()
+              << std::endl;
+}
+
+float PivotTable::LowerBound(const float *query,
+                             const size_t fingerprint) const {
+  const size_t pivots = PivotIndices.size();
+  const float *distances = Distances.data() + fingerprint * pivots;
+  float bound = 0;
+  for (size_t p = 0; p < pivots; p++)
+    bound = std::max(bound, std::fabs(query[p] - distances[p]));
+  return bound;
+}
\ No newline at end of file
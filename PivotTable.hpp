@@ -0,0 +1,50 @@
+#include <boost/filesystem.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Distances from every fingerprint in a set to a few pivot fingerprints
+// (LAESA). Distances between fingerprints obey the triangle inequality, so a
+// query at distance d from a pivot can only be within r of fingerprints whose
+// own distance to that pivot is within r of d. A query's distances to the
+// pivots rule out most of the store from this table alone.
+//
+// Distances here are the square roots of the kernel's squared distances,
+// stored as floats.
+class PivotTable {
+public:
+  // Upper limit on pivots; fewer are used when the set has fewer distinct
+  // fingerprints.
+  static const size_t MaxPivots = 32;
+
+  // Pick pivots from count fingerprints, stride bytes apart, and work out the
+  // distance from each fingerprint to each one. Pivots are chosen farthest
+  // first: each one is the fingerprint farthest from all those already
+  // chosen, which spreads them across the store. The distances are computed
+  // on the given number of threads.
+  void Build(const DistanceKernel &kernel, const uint8_t *fingerprints,
+             const size_t count, const size_t threads);
+
+  // Read a table saved for the same fingerprints, identified by a checksum of
+  // them. False if there's none, or it's for some other set of fingerprints.
+  bool Read(const boost::filesystem::path &path, const uint64_t checksum,
+            const size_t count);
+
+  // Save the table for the next load. Failing to is not an error, as the store
+  // may well be read-only; it will just be built again.
+  void Write(const boost::filesystem::path &path,
+             const uint64_t checksum) const;
+
+  // Indices of the pivots among the fingerprints.
+  const std::vector<size_t> &Pivots() const { return PivotIndices; }
+
+  // The largest difference between a query's distances to the pivots and a
+  // fingerprint's, which the distance between them is at least.
+  float LowerBound(const float *query, const size_t fingerprint) const;
+
+private:
+  std::vector<size_t> PivotIndices;
+
+  // Pivots().size() distances for each fingerprint, one after another.
+  std::vector<float> Distances;
+};
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "PixelArena.hpp"
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+// Don't bother with huge pages unless at least one can be filled.
+const size_t HugePageSize = 2 * 1024 * 1024;
+
+size_t RoundUp(const size_t bytes, const size_t page) {
+  return (bytes + page - 1) / page * page;
+}
+
+// Default size of explicit huge pages, from /proc/meminfo.
+size_t ExplicitHugePageSize() {
+  std::ifstream meminfo("/proc/meminfo");
+  std::string line;
+  while (std::getline(meminfo, line)) {
+    if (line.rfind("Hugepagesize:", 0) != 0)
+      continue;
+
+    std::stringstream ss(line.substr(13));
+    size_t kB = 0;
+    ss >> kB;
+    if (kB != 0)
+      return kB * 1024;
+  }
+  return HugePageSize;
+}
+} // namespace
+
+PixelArena::PixelArena(const size_t bytes) { Allocate(bytes); }
+
+PixelArena::PixelArena(PixelArena &&other) { *this = std::move(other); }
+
+PixelArena &PixelArena::operator=(PixelArena &&other) {
+  if (this != &other) {
+    Free();
+    std::swap(Buffer, other.Buffer);
+    std::swap(Bytes, other.Bytes);
+    std::swap(Mapped, other.Mapped);
+    std::swap(Page, other.Page);
+    std::swap(Kind, other.Kind);
+  }
+  return *this;
+}
+
+PixelArena::~PixelArena() { Free(); }
+
+void PixelArena::Allocate(const size_t bytes) {
+  Bytes = bytes;
+  Page = sysconf(_SC_PAGESIZE);
+  Kind = NormalPages;
+  if (bytes == 0)
+    return;
+
+  void *mapping = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  // Explicit huge pages only work if the administrator has reserved some
+  // (vm.nr_hugepages), so failure here is expected and quiet.
+  if (bytes >= HugePageSize) {
+    size_t page = ExplicitHugePageSize();
+    size_t length = RoundUp(bytes, page);
+    mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapping != MAP_FAILED) {
+      Mapped = length;
+      Page = page;
+      Kind = ExplicitHugePages;
+    }
+  }
+#endif
+
+  if (mapping == MAP_FAILED) {
+    size_t length = RoundUp(bytes, bytes >= HugePageSize ? HugePageSize : Page);
+    mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+      throw std::bad_alloc();
+    Mapped = length;
+
+#ifdef MADV_HUGEPAGE
+    if (bytes >= HugePageSize &&
+        madvise(mapping, length, MADV_HUGEPAGE) == 0) {
+      Page = HugePageSize;
+      Kind = TransparentHugePages;
+    }
+#endif
+  }
+
+  Buffer = static_cast<uint8_t *>(mapping);
+}
+
+void PixelArena::Free() {
+  if (Buffer != nullptr)
+    munmap(Buffer, Mapped);
+  Buffer = nullptr;
+  Bytes = 0;
+  Mapped = 0;
+}
+
+std::string PixelArena::Describe() const {
+  std::stringstream ss;
+  ss << Page / 1024 << " kB";
+  switch (Kind) {
+  case NormalPages:
+    ss << " normal";
+    break;
+  case TransparentHugePages:
+    ss << " transparent huge";
+    break;
+  case ExplicitHugePages:
+    ss << " explicit huge";
+    break;
+  }
+  ss << " pages";
+  return ss.str();
+}
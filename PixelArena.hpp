@@ -0,0 +1,47 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Contiguous block of 8-bit fingerprint samples, stored one fingerprint after
+// another so that a scan over the store is a single sequential stream.
+//
+// Large arenas are backed by huge pages where the platform allows it, to keep
+// TLB misses down while scanning: explicit (hugetlbfs) pages first, then
+// transparent huge pages, falling back to normal pages.
+class PixelArena {
+public:
+  PixelArena() = default;
+
+  // The memory is left untouched, so its pages are placed on the NUMA node of
+  // whichever thread writes to them first.
+  PixelArena(const size_t bytes);
+
+  PixelArena(PixelArena &&other);
+  PixelArena &operator=(PixelArena &&other);
+  PixelArena(const PixelArena &) = delete;
+  PixelArena &operator=(const PixelArena &) = delete;
+  ~PixelArena();
+
+  uint8_t *Data() { return Buffer; }
+  const uint8_t *Data() const { return Buffer; }
+  size_t Size() const { return Bytes; }
+
+  // Size of the pages backing the arena. For transparent huge pages this is
+  // what was requested; the kernel may still use normal pages for some of it.
+  size_t PageSize() const { return Page; }
+
+  // Human readable description of the backing, e.g. "2048 kB explicit".
+  std::string Describe() const;
+
+private:
+  enum PageKind { NormalPages, TransparentHugePages, ExplicitHugePages };
+
+  void Allocate(const size_t bytes);
+  void Free();
+
+  uint8_t *Buffer = nullptr;
+  size_t Bytes = 0;
+  size_t Mapped = 0; // length of the mapping, rounded up to whole pages
+  size_t Page = 0;
+  PageKind Kind = NormalPages;
+};
@@ -0,0 +1,108 @@
+#include "CompactDct.hpp"
+#include "InvertedFile.hpp"
+#include "Util.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include "ProductQuantiser.hpp"
+
+namespace {
+// Identifies saved codebooks, and their layout.
+const char Magic[8] = {'P', 'F', 'P', 'Q', '0', '0', '0', '1'};
+} // namespace
+
+ProductQuantiser::ProductQuantiser(const size_t dimensions)
+    : DimensionCount(dimensions),
+      Subspaces((dimensions + SubspaceDimensions - 1) / SubspaceDimensions),
+      Codebooks(Subspaces * Centroids * SubspaceDimensions) {}
+
+void ProductQuantiser::Train(const float *vectors, const size_t count,
+                             const size_t threads) {
+  if (count == 0)
+    return;
+
+  // An even sample, each padded to whole subspaces with zeros.
+  size_t samples = std::min(count, SampleSize);
+  size_t stride = Subspaces * SubspaceDimensions;
+  std::vector<float> sample(samples * stride);
+  for (size_t j = 0; j < samples; j++)
+    std::copy(vectors + j * count / samples * DimensionCount,
+              vectors + (j * count / samples + 1) * DimensionCount,
+              sample.begin() + j * stride);
+
+  // With fewer vectors than centroids, some are left as copies.
+  std::mt19937_64 random(samples);
+  size_t clusters = std::min(samples, Centroids);
+  for (size_t s = 0; s < Subspaces; s++) {
+    auto centroids = InvertedFile::Cluster(
+        sample.data() + s * SubspaceDimensions, samples, stride,
+        SubspaceDimensions, clusters, random, threads);
+    float *codebook = Codebooks.data() + s * Centroids * SubspaceDimensions;
+    for (size_t c = 0; c < Centroids; c++)
+      std::copy(centroids.begin() + c % clusters * SubspaceDimensions,
+                centroids.begin() + (c % clusters + 1) * SubspaceDimensions,
+                codebook + c * SubspaceDimensions);
+  }
+}
+
+void ProductQuantiser::Encode(const float *vectors, const size_t count,
+                              uint8_t *codes, const size_t threads) const {
+  Util::Parallel(count, threads, [&](size_t first, size_t last) {
+    std::vector<float> table(TableSize());
+    for (size_t j = first; j < last; j++) {
+      DistanceTable(vectors + j * DimensionCount, table.data());
+      for (size_t s = 0; s < Subspaces; s++) {
+        const float *distances = table.data() + s * Centroids;
+        codes[j * Subspaces + s] =
+            std::min_element(distances, distances + Centroids) - distances;
+      }
+    }
+  });
+}
+
+void ProductQuantiser::DistanceTable(const float *query, float *table) const {
+  for (size_t s = 0; s < Subspaces; s++) {
+    // The padding of a short last subspace is zero in the centroids too.
+    float subvector[SubspaceDimensions] = {};
+    size_t first = s * SubspaceDimensions;
+    size_t dimensions = std::min(SubspaceDimensions, DimensionCount - first);
+    std::copy(query + first, query + first + dimensions, subvector);
+
+    const float *codebook =
+        Codebooks.data() + s * Centroids * SubspaceDimensions;
+    for (size_t c = 0; c < Centroids; c++)
+      table[s * Centroids + c] = CompactDct::SquaredDistance(
+          subvector, codebook + c * SubspaceDimensions, SubspaceDimensions);
+  }
+}
+
+bool ProductQuantiser::Read(const boost::filesystem::path &path) {
+  std::ifstream file(path.string(), std::ios::binary);
+  char magic[sizeof(Magic)];
+  uint64_t dimensions = 0;
+  file.read(magic, sizeof(magic));
+  file.read(reinterpret_cast<char *>(&dimensions), sizeof(dimensions));
+  if (!file || !std::equal(magic, magic + sizeof(magic), Magic) ||
+      dimensions != DimensionCount)
+    return false;
+
+  std::vector<float> codebooks(Codebooks.size());
+  file.read(reinterpret_cast<char *>(codebooks.data()),
+            codebooks.size() * sizeof(float));
+  if (!file)
+    return false;
+
+  Codebooks = std::move(codebooks);
+  return true;
+}
+
+bool ProductQuantiser::Write(const boost::filesystem::path &path) const {
+  return Util::WriteAtomically(path, [&](std::ostream &file) {
+    uint64_t dimensions = DimensionCount;
+    file.write(Magic, sizeof(Magic));
+    file.write(reinterpret_cast<const char *>(&dimensions), sizeof(dimensions));
+    file.write(reinterpret_cast<const char *>(Codebooks.data()),
+               Codebooks.size() * sizeof(float));
+  });
+}
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include <boost/filesystem.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Product quantisation of compact fingerprint vectors: each vector is cut
+// into short subvectors, and each of those replaced by the nearest of 256
+// centroids trained for its subspace, so a vector becomes a code of one byte
+// per subspace. A query's distance to every code is then the sum of a table
+// lookup per byte (asymmetric distance computation: the query itself isn't
+// quantised), which scans millions of codes a second from a table that fits
+// in L1.
+class ProductQuantiser {
+public:
+  static const size_t Centroids = 256;
+
+  // Dimensions per subspace; the last may have fewer.
+  static const size_t SubspaceDimensions = 8;
+
+  // Vectors the centroids are trained on, at most.
+  static const size_t SampleSize = 16384;
+
+  ProductQuantiser(const size_t dimensions);
+
+  // Bytes per code, and floats per distance table.
+  size_t CodeBytes() const { return Subspaces; }
+  size_t TableSize() const { return Subspaces * Centroids; }
+
+  // Train each subspace's centroids on an even sample of count vectors.
+  void Train(const float *vectors, const size_t count, const size_t threads);
+
+  // Encode count vectors into CodeBytes() each, on the given number of
+  // threads.
+  void Encode(const float *vectors, const size_t count, uint8_t *codes,
+              const size_t threads) const;
+
+  // Squared distances from each of a query's subvectors to every centroid of
+  // its subspace, for Distance().
+  void DistanceTable(const float *query, float *table) const;
+
+  // Approximate squared distance from a query to an encoded vector.
+  float Distance(const float *table, const uint8_t *code) const {
+    float sum = 0;
+    for (size_t s = 0; s < Subspaces; s++)
+      sum += table[s * Centroids + code[s]];
+    return sum;
+  }
+
+  // Load centroids saved by Write() for vectors of the same dimensions.
+  bool Read(const boost::filesystem::path &path);
+  bool Write(const boost::filesystem::path &path) const;
+
+private:
+  size_t DimensionCount;
+  size_t Subspaces;
+
+  // Centroids of subspace s start at s * Centroids * SubspaceDimensions, each
+  // padded out to SubspaceDimensions.
+  std::vector<float> Codebooks;
+};
\ No newline at end of file
@@ -0,0 +1,39 @@
+#include "TaskQueue.hpp"
+
+TaskQueue::TaskQueue(const size_t workers)
+    : WorkerCount(workers), Producers(workers) {}
+
+void TaskQueue::Push(std::vector<Task> tasks) {
+  std::lock_guard<std::mutex> lock(Mutex);
+  for (auto &task : tasks)
+    Tasks.push_back(std::move(task));
+  Changed.notify_all();
+}
+
+void TaskQueue::RunUntil(const size_t node,
+                         const std::function<bool()> &done) {
+  std::unique_lock<std::mutex> lock(Mutex);
+  while (!done()) {
+    if (Tasks.empty()) {
+      Changed.wait(lock);
+      continue;
+    }
+
+    Task task = std::move(Tasks.front());
+    Tasks.pop_front();
+    lock.unlock();
+    task(node);
+    lock.lock();
+    Changed.notify_all();
+  }
+}
+
+void TaskQueue::RemoveProducer() {
+  std::lock_guard<std::mutex> lock(Mutex);
+  Producers--;
+  Changed.notify_all();
+}
+
+void TaskQueue::RunUntilDrained(const size_t node) {
+  RunUntil(node, [this] { return Tasks.empty() && Producers == 0; });
+}
\ No newline at end of file
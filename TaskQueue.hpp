@@ -0,0 +1,41 @@
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Tasks shared between the worker threads, so that work one of them creates
+// can be split up and run by any of them. A worker waiting for its own tasks
+// runs whatever is queued in the meantime, and workers with nothing else left
+// to do keep running tasks until no more can arrive.
+class TaskQueue {
+public:
+  // Tasks are called with the NUMA node of the thread running them.
+  using Task = std::function<void(const size_t node)>;
+
+  // Every one of the workers is a producer until it says otherwise.
+  TaskQueue(const size_t workers);
+
+  size_t Workers() const { return WorkerCount; }
+
+  void Push(std::vector<Task> tasks);
+
+  // Run queued tasks on this thread until done() is true. It is checked with
+  // the queue locked, after each task (on any thread) finishes.
+  void RunUntil(const size_t node, const std::function<bool()> &done);
+
+  // The calling worker won't push any more tasks.
+  void RemoveProducer();
+
+  // Run queued tasks until the queue is empty and no producers remain.
+  void RunUntilDrained(const size_t node);
+
+private:
+  size_t WorkerCount;
+  size_t Producers;
+
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  std::deque<Task> Tasks;
+};
\ No newline at end of file
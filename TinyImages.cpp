@@ -0,0 +1,106 @@
+#include "Util.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "TinyImages.hpp"
+
+namespace {
+uint32_t SadScalar(const uint8_t *a, const uint8_t *b) {
+  uint32_t sum = 0;
+  for (size_t j = 0; j < TinyImages::Bytes; j++)
+    sum += std::abs(int(a[j]) - int(b[j]));
+  return sum;
+}
+
+#if defined(__x86_64__)
+// Two psadbw cover all 64 bytes, leaving four partial sums to add up.
+__attribute__((target("avx2"))) uint32_t SadAvx2(const uint8_t *a,
+                                                 const uint8_t *b) {
+  auto a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a));
+  auto a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + 32));
+  auto b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+  auto b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + 32));
+  auto sums =
+      _mm256_add_epi64(_mm256_sad_epu8(a0, b0), _mm256_sad_epu8(a1, b1));
+  auto half = _mm_add_epi64(_mm256_castsi256_si128(sums),
+                            _mm256_extracti128_si256(sums, 1));
+  return uint32_t(_mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1));
+}
+
+bool HaveAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+} // namespace
+
+TinyImages::TinyImages(const size_t width, const size_t height)
+    : Width(width), Height(height), Sad(SadScalar) {
+#if defined(__x86_64__)
+  if (HaveAvx2())
+    Sad = SadAvx2;
+#endif
+
+  // Geometries under 8 pixels across leave some cells empty, which are 0 in
+  // every thumbnail and so never add to the difference.
+  for (size_t y = 0; y < Side; y++) {
+    size_t rows = (y + 1) * Height / Side - y * Height / Side;
+    for (size_t x = 0; x < Side; x++) {
+      size_t pixels = rows * ((x + 1) * Width / Side - x * Width / Side);
+      if (pixels == 0)
+        continue;
+      SmallestCell = Cells++ == 0 ? pixels : std::min(SmallestCell, pixels);
+    }
+  }
+}
+
+void TinyImages::Shrink(const uint8_t *samples, uint8_t *tiny) const {
+  for (size_t y = 0; y < Side; y++) {
+    size_t top = y * Height / Side, bottom = (y + 1) * Height / Side;
+    for (size_t x = 0; x < Side; x++) {
+      size_t left = x * Width / Side, right = (x + 1) * Width / Side;
+      uint64_t sum = 0;
+      for (size_t row = top; row < bottom; row++)
+        for (size_t j = (row * Width + left) * 3; j < (row * Width + right) * 3;
+             j++)
+          sum += samples[j];
+
+      // Rounded to nearest, so never more than half a level out.
+      uint64_t count = 3 * (bottom - top) * (right - left);
+      tiny[y * Side + x] =
+          count == 0 ? 0 : uint8_t((2 * sum + count) / (2 * count));
+    }
+  }
+}
+
+void TinyImages::Build(const uint8_t *fingerprints, const size_t count,
+                       const size_t stride, const size_t threads) {
+  Images.resize(count * Bytes);
+  Util::Parallel(count, threads, [&](size_t first, size_t last) {
+    for (size_t j = first; j < last; j++)
+      Shrink(fingerprints + j * stride, Images.data() + j * Bytes);
+  });
+}
+
+uint32_t TinyImages::Threshold(const double squaredLimit) const {
+  // A cell of n pixels whose thumbnail pixels differ by d has samples whose
+  // sums differ by at least 3n(d - 1), so squared differences of at least
+  // 3n(d - 1)^2 (Cauchy-Schwarz). Over the cells, the sum of (d - 1)^2 is at
+  // least the square of the sum of d - 1 over the cell count (again), so
+  // the full squared distance is at least 3 SmallestCell (sad - Cells)^2 /
+  // Cells.
+  if (Cells == 0)
+    return UINT32_MAX;
+  // Nudged up, as the square root could round just under a whole number.
+  double slack = std::sqrt(squaredLimit * Cells / (3.0 * SmallestCell));
+  return uint32_t(Cells + std::floor(slack * (1 + 1e-9)));
+}
+
+std::string TinyImages::Describe() const {
+  return std::to_string(Side) + "x" + std::to_string(Side) +
+         (Sad == SadScalar ? "" : " AVX2") + " thumbnails";
+}
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// An 8x8 grayscale thumbnail of every fingerprint, 64 bytes each and packed
+// together, compared by their sum of absolute differences with psadbw where
+// the CPU has AVX2. Each thumbnail pixel is the mean of every sample in its
+// cell rounded to 8 bits, so (Cauchy-Schwarz, twice, allowing half a level of
+// rounding either side) a sum of absolute differences over Threshold() rules
+// out a pair as surely as their full distance would.
+class TinyImages {
+public:
+  static const size_t Side = 8;
+  static const size_t Bytes = Side * Side;
+
+  TinyImages(const size_t width, const size_t height);
+
+  // Shrink a fingerprint's interleaved 8-bit RGB samples to its thumbnail.
+  void Shrink(const uint8_t *samples, uint8_t *tiny) const;
+
+  // Shrink count fingerprints, stride bytes apart, on the given number of
+  // threads.
+  void Build(const uint8_t *fingerprints, const size_t count,
+             const size_t stride, const size_t threads);
+
+  const uint8_t *Image(const size_t fingerprint) const {
+    return Images.data() + fingerprint * Bytes;
+  }
+
+  uint32_t Distance(const uint8_t *a, const uint8_t *b) const {
+    return Sad(a, b);
+  }
+
+  // The largest sum of absolute differences two thumbnails can have when
+  // their fingerprints are within the square root of squaredLimit.
+  uint32_t Threshold(const double squaredLimit) const;
+
+  // e.g. "8x8 AVX2 thumbnails"
+  std::string Describe() const;
+
+private:
+  size_t Width;
+  size_t Height;
+
+  // Cells with at least one pixel, and the fewest pixels in any of them.
+  size_t Cells = 0;
+  size_t SmallestCell = 0;
+
+  uint32_t (*Sad)(const uint8_t *a, const uint8_t *b);
+  std::vector<uint8_t> Images;
+};
\ No newline at end of file
@@ -1,13 +1,100 @@
 #include "Util.hpp"
+#include <boost/algorithm/string.hpp>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
 
 bool Util::IsSupportedImage(const boost::filesystem::path filename) {
-  auto ext = filename.extension().string();
+  auto ext = boost::algorithm::to_lower_copy(filename.extension().string());
 
-  // TODO: case correction
-  if (ext == ".jpg" || ext == ".JPG" || ext == ".png" || ext == ".PNG" ||
-      ext == ".jpeg" || ext == ".JPEG" || ext == ".tif" || ext == ".tiff" ||
-      ext == ".TIF" || ext == ".TIFF" || ext == ".cr2" || ext == ".CR2") {
+  if (ext == ".jpg" || ext == ".png" || ext == ".jpeg" || ext == ".tif" ||
+      ext == ".tiff" || ext == ".cr2") {
     return true;
   }
   return false;
+}
+
+std::optional<std::string> Util::SniffImageFormat(const uint8_t *header,
+                                                  const size_t length) {
+  auto startsWith = [&](const char *magic, const size_t offset = 0) {
+    size_t n = strlen(magic);
+    return length >= offset + n && memcmp(header + offset, magic, n) == 0;
+  };
+
+  if (startsWith("\xFF\xD8\xFF"))
+    return "JPEG";
+  if (startsWith("\x89PNG\r\n\x1A\n"))
+    return "PNG";
+  if (startsWith("GIF87a") || startsWith("GIF89a"))
+    return "GIF";
+  if (startsWith("RIFF") && startsWith("WEBP", 8))
+    return "WEBP";
+  if (startsWith("ftypheic", 4) || startsWith("ftypheix", 4) ||
+      startsWith("ftypmif1", 4))
+    return "HEIC";
+
+  // Canon raw files are TIFF structured, with "CR" after the header.
+  bool tiff = startsWith("II*") || (startsWith("MM") && startsWith("*", 3));
+  if (tiff && startsWith("CR", 8))
+    return "CR2";
+  if (tiff)
+    return "TIFF";
+
+  return std::nullopt;
+}
+
+std::optional<std::string>
+Util::SniffImageFormat(const boost::filesystem::path filename) {
+  uint8_t header[SniffLength];
+  ssize_t length = -1;
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    length = pread(fd, header, sizeof(header), 0);
+    close(fd);
+  }
+
+  if (length <= 0)
+    return std::nullopt;
+  return SniffImageFormat(header, length);
+}
+
+size_t Util::L2CacheBytes() {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  long bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (bytes > 0)
+    return bytes;
+#endif
+  return 1024 * 1024;
+}
+
+bool Util::IsArchive(const boost::filesystem::path filename) {
+  auto name = boost::algorithm::to_lower_copy(filename.filename().string());
+
+  for (auto suffix : {".zip", ".tar", ".tar.gz", ".tgz", ".tar.bz2", ".tbz2",
+                      ".tar.xz", ".txz"}) {
+    if (boost::algorithm::ends_with(name, suffix))
+      return true;
+  }
+  return false;
+}
+
+bool Util::WriteAtomically(const boost::filesystem::path path,
+                           const std::function<void(std::ostream &)> write) {
+  auto temporary = path;
+  temporary += ".tmp";
+  boost::system::error_code error;
+  {
+    std::ofstream file(temporary.string(), std::ios::binary);
+    if (file)
+      write(file);
+    if (!file) {
+      boost::filesystem::remove(temporary, error);
+      return false;
+    }
+  }
+
+  boost::filesystem::rename(temporary, path, error);
+  return !error;
 }
\ No newline at end of file
@@ -1,7 +1,70 @@
 #include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
 
 // FIXME: Find a better place for this
 class Util {
 public:
   static bool IsSupportedImage(const boost::filesystem::path filename);
+
+  // Identify an image from the magic bytes at the start of the file, returning
+  // the ImageMagick format to decode it with, or nullopt if it isn't an image
+  // format we handle. Much cheaper than letting a decode attempt fail.
+  static std::optional<std::string> SniffImageFormat(const uint8_t *header,
+                                                     const size_t length);
+  static std::optional<std::string>
+  SniffImageFormat(const boost::filesystem::path filename);
+
+  // Enough of the header for every format SniffImageFormat knows.
+  static const size_t SniffLength = 16;
+
+  // Size of the (per core) L2 cache, or a typical size if it can't be found.
+  static size_t L2CacheBytes();
+
+  // Zip and (possibly compressed) tar archives, which the walker can read.
+  static bool IsArchive(const boost::filesystem::path filename);
+
+  // Replace a file with whatever write puts in the stream, by way of a
+  // temporary file alongside it so nobody ever reads half of one. Returns
+  // false, leaving any existing file alone, if it couldn't be written.
+  static bool WriteAtomically(const boost::filesystem::path path,
+                              const std::function<void(std::ostream &)> write);
+
+  // Sort items 0 to count - 1 into buckets by key(item), keeping each bucket
+  // in item order (a counting sort). Bucket b's items are entries[offsets[b]]
+  // up to entries[offsets[b + 1]], like a compressed sparse row matrix.
+  template <typename Key>
+  static void Bucket(const size_t count, const size_t buckets, Key key,
+                     std::vector<uint32_t> &offsets,
+                     std::vector<uint32_t> &entries) {
+    offsets.assign(buckets + 1, 0);
+    for (size_t j = 0; j < count; j++)
+      offsets[key(j) + 1]++;
+    for (size_t b = 0; b < buckets; b++)
+      offsets[b + 1] += offsets[b];
+
+    entries.resize(count);
+    std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+    for (size_t j = 0; j < count; j++)
+      entries[next[key(j)]++] = j;
+  }
+
+  // Run body(first, last) over count items split evenly between as many
+  // threads as given.
+  template <typename Body>
+  static void Parallel(const size_t count, const size_t threads, Body body) {
+    size_t threadCount = std::max<size_t>(1, std::min(threads, count));
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threadCount; t++)
+      workers.push_back(std::thread(body, count * t / threadCount,
+                                    count * (t + 1) / threadCount));
+    for (auto &worker : workers)
+      worker.join();
+  }
 };
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "Util.hpp"
+#include <algorithm>
+#include <cmath>
+
+#include "WaveletIndex.hpp"
+
+namespace {
+// Posting lists: a channel, a sign and a position.
+const size_t Keys = 3 * 2 * WaveletIndex::Size * WaveletIndex::Size;
+
+// imgSeek's weights for scanned pictures, for each channel of YIQ by how
+// coarse the coefficient is (the larger of its row and column, up to 5).
+// The first row weighs the difference in the averages.
+const float Weights[6][3] = {{5.00f, 19.21f, 34.37f}, {0.83f, 1.26f, 0.36f},
+                             {1.01f, 0.44f, 0.45f},   {0.52f, 0.53f, 0.14f},
+                             {0.47f, 0.28f, 0.18f},   {0.30f, 0.14f, 0.27f}};
+
+size_t Bin(const size_t position) {
+  size_t row = position / WaveletIndex::Size;
+  size_t column = position % WaveletIndex::Size;
+  return std::min<size_t>(std::max(row, column), 5);
+}
+
+// One step at a time, averages to the front and differences behind them,
+// orthonormally.
+void Haar(float *data, const size_t count, const size_t step) {
+  float scratch[WaveletIndex::Size];
+  for (size_t half = count / 2; half > 0; half /= 2) {
+    for (size_t k = 0; k < half; k++) {
+      float a = data[2 * k * step], b = data[(2 * k + 1) * step];
+      scratch[k] = (a + b) * float(M_SQRT1_2);
+      scratch[half + k] = (a - b) * float(M_SQRT1_2);
+    }
+    for (size_t k = 0; k < 2 * half; k++)
+      data[k * step] = scratch[k];
+  }
+}
+} // namespace
+
+WaveletIndex::WaveletIndex(const size_t width, const size_t height)
+    : Width(width), Height(height) {}
+
+void WaveletIndex::Decompose(const uint8_t *samples, float *averages,
+                             uint16_t *keys) const {
+  const size_t area = Size * Size;
+  std::vector<float> channels(3 * area);
+
+  // Each cell averages the pixels under it, or the nearest one when the
+  // fingerprint is smaller than the signature.
+  for (size_t y = 0; y < Size; y++) {
+    size_t top = y * Height / Size;
+    size_t bottom = std::max((y + 1) * Height / Size, top + 1);
+    for (size_t x = 0; x < Size; x++) {
+      size_t left = x * Width / Size;
+      size_t right = std::max((x + 1) * Width / Size, left + 1);
+      float rgb[3] = {0, 0, 0};
+      for (size_t row = top; row < bottom; row++)
+        for (size_t column = left; column < right; column++)
+          for (size_t c = 0; c < 3; c++)
+            rgb[c] += samples[(row * Width + column) * 3 + c];
+      float scale = 1.0f / (255.0f * (bottom - top) * (right - left));
+      float r = rgb[0] * scale, g = rgb[1] * scale, b = rgb[2] * scale;
+      channels[y * Size + x] = 0.299f * r + 0.587f * g + 0.114f * b;
+      channels[area + y * Size + x] = 0.596f * r - 0.275f * g - 0.321f * b;
+      channels[2 * area + y * Size + x] = 0.212f * r - 0.523f * g + 0.311f * b;
+    }
+  }
+
+  size_t positions[Size * Size - 1];
+  for (size_t c = 0; c < 3; c++) {
+    float *data = channels.data() + c * area;
+    for (size_t row = 0; row < Size; row++)
+      Haar(data + row * Size, Size, 1);
+    for (size_t column = 0; column < Size; column++)
+      Haar(data + column, Size, Size);
+    averages[c] = data[0] / Size;
+
+    // The average isn't a coefficient to match on, having its own weight.
+    for (size_t p = 1; p < area; p++)
+      positions[p - 1] = p;
+    std::nth_element(positions, positions + Kept - 1, positions + area - 1,
+                     [&](size_t a, size_t b) {
+                       return std::fabs(data[a]) > std::fabs(data[b]);
+                     });
+    for (size_t k = 0; k < Kept; k++) {
+      size_t p = positions[k];
+      keys[c * Kept + k] = uint16_t((c * 2 + (data[p] < 0)) * area + p);
+    }
+  }
+}
+
+void WaveletIndex::Build(const uint8_t *fingerprints, const size_t count,
+                         const size_t stride, const size_t threads) {
+  const size_t perFingerprint = 3 * Kept;
+  std::vector<uint16_t> keys(count * perFingerprint);
+  Averages.resize(count * 3);
+  Util::Parallel(count, threads, [&](size_t first, size_t last) {
+    for (size_t j = first; j < last; j++)
+      Decompose(fingerprints + j * stride, Averages.data() + j * 3,
+                keys.data() + j * perFingerprint);
+  });
+
+  // Bucketed by coefficient, and then from coefficients to fingerprints.
+  Util::Bucket(
+      keys.size(), Keys, [&](size_t i) { return keys[i]; }, Offsets, Entries);
+  for (auto &entry : Entries)
+    entry /= perFingerprint;
+}
+
+std::vector<uint32_t> WaveletIndex::Nearest(const uint8_t *query,
+                                            const size_t candidates) const {
+  float averages[3];
+  uint16_t keys[3 * Kept];
+  Decompose(query, averages, keys);
+
+  // Lower is better: the difference in averages, less the weight of every
+  // coefficient in common.
+  const size_t count = Averages.size() / 3;
+  thread_local std::vector<float> scores;
+  scores.resize(count);
+  for (size_t j = 0; j < count; j++) {
+    float score = 0;
+    for (size_t c = 0; c < 3; c++)
+      score += Weights[0][c] * std::fabs(averages[c] - Averages[j * 3 + c]);
+    scores[j] = score;
+  }
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t k = 0; k < Kept; k++) {
+      uint16_t key = keys[c * Kept + k];
+      float weight = Weights[Bin(key % (Size * Size))][c];
+      for (size_t e = Offsets[key]; e < Offsets[key + 1]; e++)
+        scores[Entries[e]] -= weight;
+    }
+  }
+
+  std::vector<uint32_t> best(count);
+  for (size_t j = 0; j < count; j++)
+    best[j] = j;
+  if (candidates < count) {
+    std::nth_element(
+        best.begin(), best.begin() + candidates, best.end(),
+        [&](uint32_t a, uint32_t b) { return scores[a] < scores[b]; });
+    best.resize(candidates);
+  }
+  return best;
+}
\ No newline at end of file
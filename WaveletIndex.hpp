@@ -0,0 +1,51 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Haar wavelet signatures of fingerprints, as in Jacobs, Finkelstein and
+// Salesin's "Fast Multiresolution Image Querying" (and imgSeek after it).
+// Each fingerprint is averaged down to Size x Size, converted to YIQ and
+// decomposed, and only the signs and positions of its Kept largest
+// coefficients per channel are remembered, along with the channel averages.
+//
+// An inverted index maps each (channel, position, sign) to the fingerprints
+// with that coefficient, so a query is scored only against the posting lists
+// of its own coefficients. Scores say which fingerprints look roughly alike,
+// not how far apart they are, so the best are only candidates to compare.
+class WaveletIndex {
+public:
+  // Side of the square each fingerprint is decomposed at.
+  static const size_t Size = 32;
+
+  // Coefficients kept per channel.
+  static const size_t Kept = 40;
+
+  WaveletIndex(const size_t width, const size_t height);
+
+  // Work out the signatures of count fingerprints of the geometry given, in
+  // interleaved 8-bit RGB, stride bytes apart, on the given number of
+  // threads, and index them.
+  void Build(const uint8_t *fingerprints, const size_t count,
+             const size_t stride, const size_t threads);
+
+  // The given number of best scoring fingerprints (by their index in
+  // Build()) for a query fingerprint, in no particular order.
+  std::vector<uint32_t> Nearest(const uint8_t *query,
+                                const size_t candidates) const;
+
+private:
+  // Work out a fingerprint's channel averages, and the posting list each of
+  // its kept coefficients belongs in, channel by channel.
+  void Decompose(const uint8_t *samples, float *averages,
+                 uint16_t *keys) const;
+
+  size_t Width;
+  size_t Height;
+
+  // Three channel averages per fingerprint.
+  std::vector<float> Averages;
+
+  // The posting lists, as bucketed by Util::Bucket().
+  std::vector<uint32_t> Offsets;
+  std::vector<uint32_t> Entries;
+};
\ No newline at end of file
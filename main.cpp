@@ -3,7 +3,22 @@
 #include <iostream>
 #include <thread>
 
+#include "ColourMoments.hpp"
+#include "CompactDct.hpp"
+#include "DecodeWatchdog.hpp"
 #include "DirectoryWalker.hpp"
+#include "DistanceKernel.hpp"
+#include "FileReader.hpp"
+#include "HnswIndex.hpp"
+#include "InvertedFile.hpp"
+#include "LshIndex.hpp"
+#include "MemoryBudget.hpp"
+#include "PivotTable.hpp"
+#include "PixelArena.hpp"
+#include "ProductQuantiser.hpp"
+#include "TaskQueue.hpp"
+#include "TinyImages.hpp"
+#include "WaveletIndex.hpp"
 #include "FingerprintStore.hpp"
 #include "Util.hpp"
 
@@ -13,11 +28,43 @@ void usage() {
   std::cerr << " -g -s <source image directory> -d <destination directory for "
                "fingerprints>"
             << std::endl;
+  std::cerr << " -r <fingerprint resolution, default 100x100>" << std::endl;
+  std::cerr << " -i to index them for -A and -I searches as they are made"
+            << std::endl;
   std::cerr << std::endl;
   std::cerr << " Find duplicates:" << std::endl;
   std::cerr << " -f -s <fingerprint source dir> -d <image dir to be searched> "
                "-u <fuzz factor>"
             << std::endl;
+  std::cerr << " -B <number of images to compare together, default 16>"
+            << std::endl;
+  std::cerr << " -G to compare them as a matrix multiply" << std::endl;
+  std::cerr << " -A <candidates> to search an HNSW graph for approximate "
+               "matches"
+            << std::endl;
+  std::cerr << " -I <lists> to scan only the nearest inverted lists instead"
+            << std::endl;
+  std::cerr << " -P <candidates> to check only the nearest by product "
+               "quantised codes"
+            << std::endl;
+  std::cerr << " -L <tables> to check only those sharing random projection "
+               "hash buckets"
+            << std::endl;
+  std::cerr << " -H <candidates> to check only the best by wavelet signature"
+            << std::endl;
+  std::cerr << std::endl;
+  std::cerr << " Options for all modes:" << std::endl;
+  std::cerr << " -t <threads> -b <decode memory budget in megabytes>"
+            << std::endl;
+  std::cerr << " -N to replicate fingerprints per NUMA node and pin threads"
+            << std::endl;
+  std::cerr << " -q <number of files to read ahead per batch>" << std::endl;
+  std::cerr << " -M to mmap files read ahead instead of reading them"
+            << std::endl;
+  std::cerr << " -o to write results in a reproducible (sorted walk) order"
+            << std::endl;
+  std::cerr << " -T <seconds before abandoning a decode> -W <max width/height>"
+            << std::endl;
   exit(1);
 }
 
@@ -41,8 +88,25 @@ int main(int argc, char **argv) {
   bool metadataMode = false;
   int numThreads = std::thread::hardware_concurrency();
   int fuzzFactor = 0;
+  long memoryLimitMB = 0;
+  bool numa = false;
+  int queueDepth = 0;
+  bool mapFiles = false;
+  bool ordered = false;
+  int decodeTimeout = 0;
+  long maxDimension = 0;
+  unsigned int specWidth = 100, specHeight = 100;
+  int batchSize = 16;
+  bool matrixMultiply = false;
+  bool indexGenerated = false;
+  int searchBreadth = 0;
+  int probes = 0;
+  int shortlist = 0;
+  int tables = 0;
+  int scored = 0;
 
-  while ((ch = getopt(argc, argv, "mgfd:s:t:u:")) != -1) {
+  while ((ch = getopt(argc, argv, "mgfioGMNA:B:H:I:L:P:b:d:q:r:s:t:u:T:W:")) !=
+         -1) {
     switch (ch) {
     case 'm':
       metadataMode = true;
@@ -53,6 +117,9 @@ int main(int argc, char **argv) {
     case 'f':
       findDuplicateMode = true;
       break;
+    case 'i':
+      indexGenerated = true;
+      break;
     case 's':
       srcDirectory = optarg;
       break;
@@ -65,6 +132,62 @@ int main(int argc, char **argv) {
     case 'u':
       fuzzFactor = atoi(optarg);
       break;
+    case 'b':
+      memoryLimitMB = atol(optarg);
+      break;
+    case 'N':
+      numa = true;
+      break;
+    case 'q':
+      queueDepth = atoi(optarg);
+      break;
+    case 'M':
+      mapFiles = true;
+      break;
+    case 'o':
+      ordered = true;
+      break;
+    case 'T':
+      decodeTimeout = atoi(optarg);
+      break;
+    case 'W':
+      maxDimension = atol(optarg);
+      break;
+    case 'B':
+      batchSize = atoi(optarg);
+      break;
+    case 'G':
+      matrixMultiply = true;
+      break;
+    case 'A':
+      searchBreadth = atoi(optarg);
+      if (searchBreadth < 1)
+        usage();
+      break;
+    case 'H':
+      scored = atoi(optarg);
+      if (scored < 1)
+        usage();
+      break;
+    case 'I':
+      probes = atoi(optarg);
+      if (probes < 1)
+        usage();
+      break;
+    case 'L':
+      tables = atoi(optarg);
+      if (tables < 1)
+        usage();
+      break;
+    case 'P':
+      shortlist = atoi(optarg);
+      if (shortlist < 1)
+        usage();
+      break;
+    case 'r':
+      if (sscanf(optarg, "%ux%u", &specWidth, &specHeight) != 2)
+        usage();
+      break;
     default:
       usage();
     }
@@ -82,6 +205,35 @@ int main(int argc, char **argv) {
   // Check for a sensible number of threads
   if (numThreads < 1)
     usage();
+
+  // A budget of 0 means unlimited
+  if (memoryLimitMB < 0)
+    usage();
+
+  // A queue depth of 0 disables the reader stage, which mapping needs
+  if (queueDepth < 0 || (mapFiles && queueDepth == 0))
+    usage();
+
+  // Zero means no timeout and no size limit
+  if (decodeTimeout < 0 || maxDimension < 0)
+    usage();
+
+  // Every query has to be compared in some batch
+  if (batchSize < 1)
+    usage();
+
+  // Fingerprints of a single pixel can't tell anything apart, and past 1024
+  // pixels a side they'd take more memory than they could ever be worth
+  if (specWidth < 1 || specHeight < 1 || specWidth > 1024 ||
+      specHeight > 1024 || specWidth * specHeight < 4)
+    usage();
+
+  // Pathologically large images are refused by ImageMagick up front, rather
+  // than being left to the watchdog.
+  if (maxDimension > 0) {
+    Magick::ResourceLimits::width(maxDimension);
+    Magick::ResourceLimits::height(maxDimension);
+  }
   std::cerr << "Using " << numThreads << " threads of maximum "
             << std::thread::hardware_concurrency() << std::endl;
 
@@ -91,6 +243,22 @@ int main(int argc, char **argv) {
 
   FingerprintStore fs(srcDirectory);
   WorkerOptions options = {numThreads, fuzzFactor, dstDirectory};
+  options.MemoryLimit = size_t(memoryLimitMB) * 1024 * 1024;
+  options.Numa = numa;
+  options.QueueDepth = queueDepth;
+  options.MapFiles = mapFiles;
+  options.Ordered = ordered;
+  options.DecodeTimeout = decodeTimeout;
+  options.GenerateSpec = std::to_string(specWidth) + "x" +
+                         std::to_string(specHeight) + "!";
+  options.BatchSize = batchSize;
+  options.MatrixMultiply = matrixMultiply;
+  options.IndexGenerated = indexGenerated;
+  options.Approximate.Breadth = searchBreadth;
+  options.Approximate.Probes = probes;
+  options.Approximate.Shortlist = shortlist;
+  options.Approximate.Tables = tables;
+  options.Approximate.Scored = scored;
 
   if (metadataMode) {
     options.WType = MetadataWorker;
@@ -109,7 +277,7 @@ int main(int argc, char **argv) {
 
   if (findDuplicateMode) {
     options.WType = FingerprintWorker;
-    fs.Load();
+    fs.Load(options.NumThreads, options.Approximate);
     fs.RunWorkers(options);
   }
 